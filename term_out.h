@@ -0,0 +1,341 @@
+// Terminal output layer shared by flap.c and tetris.c: a cell framebuffer that
+// is diffed against what the terminal shows, sent with the fewest escape
+// bytes it can find and coalesced into one write() per frame.
+//
+// The layer tracks the terminal's cursor position and SGR colour across
+// frames, so it only re-sends a colour when it changes and picks the
+// shortest way to reach the next changed cell: nothing, printing over the
+// unchanged cells in between, a relative move, CR/LF, or an absolute move.
+#ifndef TERM_OUT_H
+#define TERM_OUT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// One character cell of the screen: glyph plus SGR foreground code (0 = default)
+typedef struct {
+    char glyph;
+    uint8_t color;
+} Cell;
+
+int fb_width, fb_height; // framebuffer size, owned by whoever renders
+Cell *front_buf; // what the terminal currently shows
+Cell *back_buf;  // frame being composed
+char *out_buf;
+size_t out_len, out_cap;
+
+// What the terminal is doing right now, -1 when we can't be sure
+int term_row = -1, term_col = -1, term_color = -1;
+int sync_output = 0; // wrap frames in synchronized output mode (DEC 2026)
+
+// Output accounting
+long frames_drawn;
+long frame_bytes, frame_escapes;  // last frame
+long total_bytes, total_escapes;
+long peak_bytes;
+// Cursor and colour bytes actually sent, and what one absolute move per
+// jump plus a colour code per change within the frame would have cost
+long total_escape_bytes, total_naive_escape_bytes;
+
+void out_reserve(size_t n) {
+    if (out_len + n <= out_cap) return;
+    while (out_len + n > out_cap) out_cap = out_cap ? out_cap * 2 : 4096;
+    out_buf = realloc(out_buf, out_cap);
+}
+
+void out_bytes(const char *s, size_t n) {
+    out_reserve(n);
+    memcpy(out_buf + out_len, s, n);
+    out_len += n;
+}
+
+void out_escape(const char *fmt, int a, int b) {
+    char tmp[32];
+    int n = snprintf(tmp, sizeof(tmp), fmt, a, b);
+    out_bytes(tmp, n);
+    frame_escapes++;
+}
+
+void out_write() {
+    size_t off = 0;
+    while (off < out_len) {
+        ssize_t n = write(STDOUT_FILENO, out_buf + off, out_len - off);
+        if (n <= 0) break;
+        off += n;
+    }
+    out_len = 0;
+}
+
+int digits(int v) {
+    int n = 1;
+    while (v >= 10) {
+        v /= 10;
+        n++;
+    }
+    return n;
+}
+
+// Forget where the cursor is and which colour is set, e.g. after writing
+// to the terminal behind the layer's back
+void term_invalidate() {
+    term_row = term_col = term_color = -1;
+}
+
+// Terminals known to honour DEC mode 2026. Others would ignore it anyway,
+// but there's no point sending 16 bytes a frame to them.
+int terminal_has_sync() {
+    const char *term = getenv("TERM");
+    const char *program = getenv("TERM_PROGRAM");
+    const char *terms[] = {"xterm-kitty", "foot", "alacritty", "wezterm", "contour", "xterm-ghostty"};
+    const char *programs[] = {"WezTerm", "iTerm.app", "ghostty", "contour"};
+    for (size_t i = 0; term && i < sizeof(terms) / sizeof(terms[0]); i++) {
+        if (strncmp(term, terms[i], strlen(terms[i])) == 0) return 1;
+    }
+    for (size_t i = 0; program && i < sizeof(programs) / sizeof(programs[0]); i++) {
+        if (strcmp(program, programs[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+void fb_init(int w, int h) {
+    fb_width = w;
+    fb_height = h;
+    size_t n = (size_t)fb_width * fb_height;
+    front_buf = malloc(n * sizeof(Cell));
+    back_buf = malloc(n * sizeof(Cell));
+    for (size_t i = 0; i < n; i++) {
+        front_buf[i] = (Cell){' ', 0}; // screen was just cleared
+        back_buf[i] = (Cell){' ', 0};
+    }
+    term_invalidate();
+}
+
+// Terminal size changed: start over from a cleared screen
+void fb_resize(int w, int h) {
+    free(front_buf);
+    free(back_buf);
+    fb_init(w, h);
+    write(STDOUT_FILENO, "\e[2J", 4);
+}
+
+void fb_free() {
+    free(front_buf);
+    free(back_buf);
+    free(out_buf);
+}
+
+void fb_clear() {
+    for (int i = 0; i < fb_width * fb_height; i++) back_buf[i] = (Cell){' ', 0};
+    frame_escapes = 0;
+}
+
+void fb_put(int row, int col, char glyph, int color) {
+    if (row < 0 || row >= fb_height || col < 0 || col >= fb_width) return;
+    // Blanks look the same in any foreground colour, keep them uniform for the diff
+    back_buf[row * fb_width + col] = (Cell){glyph, glyph == ' ' ? 0 : color};
+}
+
+void fb_text(int row, int col, const char *s, int color) {
+    for (; *s; s++, col++) fb_put(row, col, *s, color);
+}
+
+// Can the unchanged cells [from, to) of a row be reprinted in the current
+// colour without changing how they look?
+int fb_gap_printable(int row, int from, int to, int color) {
+    if (to - from > 4) return 0; // a relative move is never longer than this
+    for (int col = from; col < to; col++) {
+        Cell c = front_buf[row * fb_width + col];
+        if (c.glyph != ' ' && c.color != color) return 0;
+    }
+    return 1;
+}
+
+// Cheapest way to step right from col to target on row: print over the gap
+// or CUF. Returns the byte count, and appends the bytes when emit is set.
+int fb_move_right(int row, int col, int target, int color, int emit) {
+    int gap = target - col;
+    if (gap == 0) return 0;
+    int cuf = gap == 1 ? 3 : 3 + digits(gap);
+    if (gap <= cuf && fb_gap_printable(row, col, target, color)) {
+        for (int c = col; emit && c < target; c++) out_bytes(&front_buf[row * fb_width + c].glyph, 1);
+        return gap;
+    }
+    if (emit) {
+        if (gap == 1) out_escape("\e[C", 0, 0);
+        else out_escape("\e[%dC", gap, 0);
+    }
+    return cuf;
+}
+
+// Move the cursor from (*row, *col) to (row_to, col_to) as cheaply as we can.
+// Only moves forward in screen order are asked for, and the cells skipped
+// on the way are unchanged, which is what makes printing over them valid.
+int fb_move(int *row, int *col, int row_to, int col_to, int color, int emit) {
+    int r = *row, c = *col;
+    *row = row_to;
+    *col = col_to;
+    if (r == row_to && c == col_to) return 0;
+
+    // Absolute position: \e[H, \e[rH or \e[r;cH
+    int best = row_to == 0 && col_to == 0 ? 3
+             : col_to == 0 ? 3 + digits(row_to + 1)
+             : 4 + digits(row_to + 1) + digits(col_to + 1);
+    int how = 0;
+
+    // Same row, further right
+    if (r == row_to && c >= 0 && col_to > c) {
+        int cost = fb_move_right(row_to, c, col_to, color, 0);
+        if (cost < best) {
+            best = cost;
+            how = 1;
+        }
+    }
+    // Down a few rows: CR plus one LF per row, then right from column 0
+    if (r >= 0 && row_to > r && row_to - r < best) {
+        int cost = 1 + (row_to - r) + fb_move_right(row_to, 0, col_to, color, 0);
+        if (cost < best) {
+            best = cost;
+            how = 2;
+        }
+    }
+    // Down with CUD keeping the column, then left or right
+    if (r >= 0 && c >= 0 && row_to > r) {
+        int down = row_to - r == 1 ? 3 : 3 + digits(row_to - r);
+        int cost = down + (col_to >= c ? fb_move_right(row_to, c, col_to, color, 0)
+                                       : c - col_to == 1 ? 3 : 3 + digits(c - col_to));
+        if (cost < best) {
+            best = cost;
+            how = 3;
+        }
+    }
+    if (!emit) return best;
+
+    switch (how) {
+        case 0:
+            if (row_to == 0 && col_to == 0) out_escape("\e[H", 0, 0);
+            else if (col_to == 0) out_escape("\e[%dH", row_to + 1, 0);
+            else out_escape("\e[%d;%dH", row_to + 1, col_to + 1);
+            break;
+        case 1:
+            fb_move_right(row_to, c, col_to, color, 1);
+            break;
+        case 2:
+            out_bytes("\r", 1);
+            for (int i = r; i < row_to; i++) out_bytes("\n", 1);
+            fb_move_right(row_to, 0, col_to, color, 1);
+            break;
+        case 3:
+            if (row_to - r == 1) out_escape("\e[B", 0, 0);
+            else out_escape("\e[%dB", row_to - r, 0);
+            if (col_to >= c) fb_move_right(row_to, c, col_to, color, 1);
+            else if (c - col_to == 1) out_escape("\e[D", 0, 0);
+            else out_escape("\e[%dD", c - col_to, 0);
+            break;
+    }
+    return best;
+}
+
+int fb_color_cost(int color) {
+    return color == 0 ? 3 : 3 + digits(color);
+}
+
+// Walk the cells that differ from the screen. With emit set the bytes are
+// appended to out_buf and the front buffer and terminal state catch up;
+// without it nothing changes. Returns the escape bytes it takes.
+long fb_diff(int emit, long *naive) {
+    int row_at = term_row, col_at = term_col, color = term_color;
+    int naive_row = -1, naive_col = -1, naive_color = -1;
+    long bytes = 0;
+    *naive = 0;
+
+    for (int row = 0; row < fb_height; row++) {
+        for (int col = 0; col < fb_width; col++) {
+            int i = row * fb_width + col;
+            Cell c = back_buf[i];
+            if (c.glyph == front_buf[i].glyph && c.color == front_buf[i].color) continue;
+
+            if (row != naive_row || col != naive_col) {
+                *naive += 4 + digits(row + 1) + digits(col + 1);
+                naive_row = row;
+                naive_col = col;
+            }
+            if (c.color != naive_color) {
+                *naive += 3 + digits(c.color);
+                naive_color = c.color;
+            }
+            naive_col++;
+
+            bytes += fb_move(&row_at, &col_at, row, col, color, emit);
+            // A blank only has a background, so any foreground will do
+            if (c.color != color && c.glyph != ' ') {
+                bytes += fb_color_cost(c.color);
+                if (emit && c.color == 0) out_escape("\e[m", 0, 0);
+                else if (emit) out_escape("\e[%dm", c.color, 0);
+                color = c.color;
+            }
+            // With auto-wrap off the cursor sticks at the last column
+            col_at = col + 1 < fb_width ? col + 1 : -1;
+            if (emit) {
+                out_bytes(&c.glyph, 1);
+                front_buf[i] = c;
+            }
+        }
+    }
+
+    if (emit) {
+        term_row = row_at;
+        term_col = col_at;
+        term_color = color;
+    }
+    return bytes;
+}
+
+// Bytes fb_flush() would send for the current back buffer, nothing is emitted
+long fb_diff_cost() {
+    long naive;
+    long bytes = fb_diff(0, &naive);
+    for (int i = 0; i < fb_width * fb_height; i++) {
+        if (back_buf[i].glyph != front_buf[i].glyph || back_buf[i].color != front_buf[i].color) bytes++;
+    }
+    return bytes;
+}
+
+// Send only the cells that differ from what is on screen, in a single write()
+void fb_flush() {
+    long naive;
+    total_escape_bytes += fb_diff(1, &naive);
+    total_naive_escape_bytes += naive;
+
+    if (out_len && sync_output) {
+        // Anything queued before the diff (e.g. a scroll) goes inside the update too
+        out_reserve(16);
+        memmove(out_buf + 8, out_buf, out_len);
+        memcpy(out_buf, "\e[?2026h", 8);
+        out_len += 8;
+        out_bytes("\e[?2026l", 8);
+    }
+
+    frame_bytes = out_len;
+    total_bytes += frame_bytes;
+    total_escapes += frame_escapes;
+    if (frame_bytes > peak_bytes) peak_bytes = frame_bytes;
+    frames_drawn++;
+    if (out_len) out_write();
+}
+
+void fb_print_stats() {
+    if (frames_drawn == 0) return;
+    fprintf(stderr, "frames: %ld\n", frames_drawn);
+    fprintf(stderr, "bytes/frame: %.1f avg, %ld peak\n",
+            (double)total_bytes / frames_drawn, peak_bytes);
+    fprintf(stderr, "escapes/frame: %.1f avg\n", (double)total_escapes / frames_drawn);
+    fprintf(stderr, "escape bytes/frame: %.1f avg, %.1f saved by cursor/colour tracking%s\n",
+            (double)total_escape_bytes / frames_drawn,
+            (double)(total_naive_escape_bytes - total_escape_bytes) / frames_drawn,
+            sync_output ? ", synchronized output" : "");
+}
+
+#endif
@@ -1,5 +1,11 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <termios.h>
 #include <unistd.h>
 #include <signal.h>
@@ -8,87 +14,103 @@
 #include <stdio.h>
 #include <time.h>
 
-#define BOARD_WIDTH 10
-#define BOARD_HEIGHT 20
+#include "term_out.h"
+#include "tetris_engine.h"
+#include "tetris_bot.h"
+#include "tetris_replay.h"
+#include "tetris_snapshot.h"
+
 #define BLOCK_MULT_X 2 
-#define NUM_SHAPES 7
 
 #define ESC 27
 #define FPS 60
 
 struct termios oldt, newt;
 int width, height;
+int terminal_configured = 0;
 
-typedef struct {
-    int width, height;
-    uint8_t *shape;
-} Shape;
+// Board size for new games, --size WxH
+int board_width = BOARD_WIDTH, board_height = BOARD_HEIGHT;
 
-typedef struct {
-    Shape *src_type;
-    Shape *type;
-    int x, y;
-} ActivePiece;
+// What the old clear-and-redraw renderer would have sent, for --stats
+long frame_repaint_bytes, total_repaint_bytes;
+int stats_enabled = 0;
+
+// Autoplay: the bot plans each piece, the plan is played a command per frame
+int autoplay = 0;
+Bot bot;
+Command plan[BOT_MAX_CMDS];
+int plan_len, plan_pos;
 
-ActivePiece *g_piece = NULL;
-Shape *shapes[NUM_SHAPES];
+// Keys as the input thread hands them over: a byte, or one of these
+enum { KEY_UP = 256, KEY_DOWN, KEY_RIGHT, KEY_LEFT, KEY_ESCAPE };
+#define ESC_TIMEOUT_MS 25 // a lone ESC is one not followed by more within this
 
 typedef struct {
-    int board[BOARD_HEIGHT][BOARD_WIDTH];
-    Shape hold_shape;
-    Shape* next_shape;
-    ActivePiece active_piece;
-    int total_lines;
-    int score;
-    int level;
-    int running;
-    int pause;
-    int hold_used;
-    int game_over;
-    int speed;
-} GameState;
-
-uint8_t shape_s[2*3] = {
-    0,1,1,
-    1,1,0
-};
-
-uint8_t shape_z[2*3] = {
-    1,1,0,
-    0,1,1
-};
-
-uint8_t shape_t[2*3] = {
-    0,1,0,
-    1,1,1
-};
-
-uint8_t shape_l[2*3] = {
-    0,0,1,
-    1,1,1
-};
-
-uint8_t shape_j[2*3] = {
-    1,0,0,
-    1,1,1
-};
-
-uint8_t shape_o[2*2] = {
-    1,1,
-    1,1
-};
-
-uint8_t shape_i[1*4] = {
-    1,1,1,1
-};
-
-int kbhit() {
-    struct timeval tv = {0L, 0L};
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(STDIN_FILENO, &fds);
-    return select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) > 0;
-}
+    int key;
+    double time; // monotonic, when it was read from stdin
+} KeyEvent;
+
+// Single-producer/single-consumer ring: only the input thread moves
+// key_tail, only the game loop moves key_head
+#define KEY_QUEUE 256
+KeyEvent key_queue[KEY_QUEUE];
+_Atomic size_t key_head, key_tail;
+long keys_dropped; // queue full, only touched by the input thread
+int key_event_fd = -1; // eventfd bumped on every push, for blocking waits
+
+// Delayed auto shift for left/right, in ms (--das, --arr, --release)
+int das_ms = 167, arr_ms = 33, release_ms = 100;
+// A second press within this long continues the same hold (OS repeat delay)
+#define SHIFT_CHAIN_GAP 0.7
+// Keyboards wait at least this long before they start repeating a key
+#define REPEAT_DELAY_MIN 0.15
+
+typedef struct {
+    Command cmd;       // CMD_LEFT or CMD_RIGHT, CMD_TICK when idle
+    double start;      // first press of the chain
+    double last;       // latest press or OS repeat
+    int armed;         // a single press then a pause like the OS repeat delay
+    int held;          // OS repeats seen, the game is shifting by itself
+    double next_shift;
+} ShiftState;
+ShiftState shift = {CMD_TICK};
+
+// Key-to-lock latency: key read to the frame with the locked piece sent, s
+double lock_key_time;
+double *latency_samples;
+size_t latency_count, latency_cap;
+
+// Where the main loop spends its time, for --stats
+enum { PHASE_PLAY, PHASE_PAUSED, PHASE_OVER, NUM_PHASES };
+const char *phase_names[NUM_PHASES] = {"playing", "paused", "game over"};
+int current_phase = -1;
+double phase_wall[NUM_PHASES], phase_cpu[NUM_PHASES];
+double phase_mark_wall, phase_mark_cpu;
+
+// How late each frame woke up, in JITTER_BUCKET_US buckets
+#define JITTER_BUCKETS 2048
+#define JITTER_BUCKET_US 10
+long jitter_hist[JITTER_BUCKETS];
+long jitter_count, missed_frames;
+double jitter_max;
+
+// The game's events, read by drain_events()
+EventQueue game_events;
+
+// --record: the game in progress, saved when it is left
+const char *record_path = NULL;
+Replay replay;
+
+// Undo: the game as each of the last --undo pieces came in, 'u' steps back
+int undo_depth = 32;
+SnapshotRing undo_ring;
+// Where the recording stood at each snapshot, an undo rewinds it too
+typedef struct {
+    size_t len;
+    uint64_t inputs, frames, last_frame;
+} ReplayMark;
+ReplayMark *undo_marks;
 
 double get_time_seconds() {
     struct timespec ts;
@@ -96,7 +118,169 @@ double get_time_seconds() {
     return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
+double cpu_time_seconds() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+int key_push(KeyEvent ev) {
+    size_t tail = atomic_load_explicit(&key_tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&key_head, memory_order_acquire) == KEY_QUEUE) return 0;
+    key_queue[tail % KEY_QUEUE] = ev;
+    atomic_store_explicit(&key_tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+int key_pop(KeyEvent *ev) {
+    size_t head = atomic_load_explicit(&key_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&key_tail, memory_order_acquire)) return 0;
+    *ev = key_queue[head % KEY_QUEUE];
+    atomic_store_explicit(&key_head, head + 1, memory_order_release);
+    return 1;
+}
+
+int key_pending() {
+    return atomic_load_explicit(&key_head, memory_order_relaxed) !=
+           atomic_load_explicit(&key_tail, memory_order_acquire);
+}
+
+// Next byte of stdin if one arrives within ms, else -1
+int read_byte_within(int ms) {
+    struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+    unsigned char c;
+    if (poll(&fd, 1, ms) <= 0 || read(STDIN_FILENO, &c, 1) != 1) return -1;
+    return c;
+}
+
+// After an ESC: an arrow key (CSI or SS3, modifiers ignored), a lone ESC,
+// or -1 for a sequence we have no use for
+int read_escape() {
+    int c = read_byte_within(ESC_TIMEOUT_MS);
+    if (c == 'O') {
+        c = read_byte_within(ESC_TIMEOUT_MS);
+    } else if (c == '[') {
+        // Parameters up to the final byte, e.g. \e[1;5C
+        for (int i = 0; i < 16; i++) {
+            c = read_byte_within(ESC_TIMEOUT_MS);
+            if (c < 0 || (c >= 0x40 && c <= 0x7e)) break;
+        }
+    } else {
+        return c < 0 ? KEY_ESCAPE : -1; // Alt+key
+    }
+    switch (c) {
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+    }
+    return -1;
+}
+
+// Input thread: turns stdin into timestamped key events as fast as they
+// come, so nothing waits on the frame rate and escape sequences are only
+// ever parsed whole
+void *input_main(void *arg) {
+    for (;;) {
+        unsigned char c;
+        int closed = read(STDIN_FILENO, &c, 1) != 1;
+        int key = closed ? 'q' : c == '\e' ? read_escape() : c; // stdin closed: quit
+        if (key < 0) continue;
+        if (!key_push((KeyEvent){key, get_time_seconds()})) keys_dropped++;
+        uint64_t one = 1;
+        write(key_event_fd, &one, sizeof(one));
+        if (closed) return NULL;
+    }
+}
+
+// Game command for a key during play, -1 for none
+int key_command(int key) {
+    switch (key) {
+        case KEY_UP:
+        case 'w':
+        case 'k': return CMD_ROTATE_CW;
+        case 'z': return CMD_ROTATE_CCW;
+        case KEY_RIGHT:
+        case 'l': return CMD_RIGHT;
+        case KEY_LEFT:
+        case 'h': return CMD_LEFT;
+        case KEY_DOWN:
+        case 'j': return CMD_SOFT_DROP;
+        case ' ': return CMD_HARD_DROP;
+        case 'c': return CMD_HOLD;
+    }
+    return -1;
+}
+
+void record_latency(double latency) {
+    if (latency_count == latency_cap) {
+        latency_cap = latency_cap ? latency_cap * 2 : 256;
+        latency_samples = realloc(latency_samples, latency_cap * sizeof(double));
+    }
+    latency_samples[latency_count++] = latency;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Sleep until an absolute monotonic time in seconds, returns how late it woke.
+// Absolute deadlines keep the frame rate exact however long a frame took.
+double sleep_until(double deadline) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)deadline;
+    ts.tv_nsec = (long)((deadline - (double)ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+    return get_time_seconds() - deadline;
+}
+
+// Block until the input thread has queued a key (or a signal comes in)
+void wait_for_key() {
+    while (!key_pending()) {
+        struct pollfd fd = {key_event_fd, POLLIN, 0};
+        if (poll(&fd, 1, -1) < 0) return;
+        uint64_t count;
+        read(key_event_fd, &count, sizeof(count));
+    }
+}
+
+void record_jitter(double late) {
+    long bucket = late > 0 ? (long)(late * 1e6 / JITTER_BUCKET_US) : 0;
+    if (bucket >= JITTER_BUCKETS) bucket = JITTER_BUCKETS - 1;
+    jitter_hist[bucket]++;
+    jitter_count++;
+    if (late > jitter_max) jitter_max = late;
+}
+
+// Upper edge of the bucket holding the given fraction of frames, in us
+long jitter_percentile(double fraction) {
+    long seen = 0;
+    int i;
+    for (i = 0; i < JITTER_BUCKETS - 1; i++) {
+        seen += jitter_hist[i];
+        if (seen >= fraction * jitter_count) break;
+    }
+    long edge = (i + 1) * JITTER_BUCKET_US;
+    return edge < jitter_max * 1e6 ? edge : (long)(jitter_max * 1e6);
+}
+
+// Charge the time since the last call to the phase we were in, then switch
+void enter_phase(int phase) {
+    double wall = get_time_seconds(), cpu = cpu_time_seconds();
+    if (current_phase >= 0) {
+        phase_wall[current_phase] += wall - phase_mark_wall;
+        phase_cpu[current_phase] += cpu - phase_mark_cpu;
+    }
+    phase_mark_wall = wall;
+    phase_mark_cpu = cpu;
+    current_phase = phase;
+}
+
 void reset_terminal() {
+    if (!terminal_configured) return;
+    terminal_configured = 0;
     printf("\e[m"); // reset color changes
     printf("\e[?25h"); // show cursor
     printf("\e[2J\e[H"); // clear terminal
@@ -112,254 +296,137 @@ void configure_terminal() {
     newt = oldt;
     newt.c_lflag &= ~(ICANON | ECHO);
     tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+    terminal_configured = 1;
     printf("\e[?1049h"); // switch to alternate buffer
     printf("\e[?25l"); // hide cursor
     printf("\e[2J\e[H"); // clear terminal
     printf("\e[4l"); // disable insert mode
     printf("\e[?7l");  // disable auto-wrap
+    fflush(stdout); // frames go straight to the fd from here on
     atexit(reset_terminal);
 }
 
-void initialize_shapes(Shape *shapes[]) {
-    shapes[0] = malloc(sizeof(Shape));
-    shapes[0]->shape = shape_s;
-    shapes[0]->width = 3;
-    shapes[0]->height = 2;
-
-    shapes[1] = malloc(sizeof(Shape));
-    shapes[1]->shape = shape_z;
-    shapes[1]->width = 3;
-    shapes[1]->height = 2;
-
-    shapes[2] = malloc(sizeof(Shape));
-    shapes[2]->shape = shape_t;
-    shapes[2]->width = 3;
-    shapes[2]->height = 2;
-
-    shapes[3] = malloc(sizeof(Shape));
-    shapes[3]->shape = shape_o;
-    shapes[3]->width = 2;
-    shapes[3]->height = 2;
-
-    shapes[4] = malloc(sizeof(Shape));
-    shapes[4]->shape = shape_i;
-    shapes[4]->width = 4;
-    shapes[4]->height = 1;
-
-    shapes[5] = malloc(sizeof(Shape));
-    shapes[5]->shape = shape_j;
-    shapes[5]->width = 3;
-    shapes[5]->height = 2;
-
-    shapes[6] = malloc(sizeof(Shape));
-    shapes[6]->shape = shape_l;
-    shapes[6]->width = 3;
-    shapes[6]->height = 2;
-}
-
-void update_speed(GameState *state) {
-    int lvl = state->level;
-
-    if (lvl <= 0) state->speed = 48;
-    else if (lvl == 1) state->speed = 43;
-    else if (lvl == 2) state->speed = 38;
-    else if (lvl == 3) state->speed = 33;
-    else if (lvl == 4) state->speed = 28;
-    else if (lvl == 5) state->speed = 23;
-    else if (lvl == 6) state->speed = 18;
-    else if (lvl == 7) state->speed = 13;
-    else if (lvl == 8) state->speed = 8;
-    else if (lvl == 9) state->speed = 6;
-    else if (lvl >= 10 && lvl <= 12) state->speed = 5;
-    else if (lvl >= 13 && lvl <= 15) state->speed = 4;
-    else if (lvl >= 16 && lvl <= 18) state->speed = 3;
-    else if (lvl >= 19 && lvl <= 28) state->speed = 2;
-    else state->speed = 1;
-}
-
-void spawn_piece(GameState *state) {
-    Shape *src = state->next_shape;
-    int size = src->width * src->height;
-    ActivePiece *piece = &state->active_piece;
+// Draw text at a 1-based terminal position, like the printf("\e[%d;%dH...")
+// calls this replaces. Tallies what that printf would have sent for --stats.
+void draw(int row, int col, const char *s) {
+    frame_repaint_bytes += 4 + digits(row) + digits(col) + 5 + strlen(s);
+    for (int i = 0; s[i]; i++) fb_put(row - 1, col - 1 + i, s[i], 32);
+}
 
-    if (piece->type == NULL) {
-        piece->type = malloc(sizeof(Shape));
-        piece->type->shape = malloc(sizeof(uint8_t) * size);
-    } else if (piece->type->shape == NULL) {
-        piece->type->shape = malloc(sizeof(uint8_t) * size);
-    } else {
-        // if existing buffer too small, realloc
-        piece->type->shape = realloc(piece->type->shape, sizeof(uint8_t) * size);
-    }
+// Start composing a frame
+void begin_frame() {
+    fb_clear();
+    frame_repaint_bytes = 7; // the old renderer's \e[2J\e[H
+}
 
-    memcpy(piece->type->shape, src->shape, sizeof(uint8_t) * size);
-    piece->type->width = src->width;
-    piece->type->height = src->height;
-
-    piece->src_type = src;
-    piece->x = BOARD_WIDTH / 2 - src->width / 2;
-    piece->y = 0;
-    for (int i = 0; i < piece->type->height; i++) {
-        for (int j = 0; j < piece->type->width; j++) {
-            if (piece->type->shape[i * piece->type->width + j] &&
-                state->board[piece->y + i][piece->x + j]) {
-                state->game_over = 1;
-            }
-        }
+void end_frame() {
+    total_repaint_bytes += frame_repaint_bytes;
+    fb_flush();
+}
+
+void print_stats() {
+    if (frames_drawn == 0) return;
+    fb_print_stats();
+    fprintf(stderr, "full repaint: %.1f bytes/frame\n", (double)total_repaint_bytes / frames_drawn);
+    if (bot.decisions) {
+        fprintf(stderr, "bot: %ld decisions, %.3f ms avg, %.3f ms max, %.0f nodes/decision\n",
+                bot.decisions, bot.decide_seconds * 1e3 / bot.decisions, bot.decide_max * 1e3,
+                (double)bot.nodes_searched / bot.decisions);
+    }
+    if (jitter_count) {
+        fprintf(stderr, "frame wakeup: p50 %ld us, p99 %ld us, max %.0f us late, %ld missed frames\n",
+                jitter_percentile(0.5), jitter_percentile(0.99), jitter_max * 1e6, missed_frames);
+    }
+    if (latency_count) {
+        qsort(latency_samples, latency_count, sizeof(double), compare_double);
+        fprintf(stderr, "key-to-lock latency: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms (%zu locks)\n",
+                latency_samples[latency_count / 2] * 1e3, latency_samples[latency_count * 9 / 10] * 1e3,
+                latency_samples[latency_count * 99 / 100] * 1e3, latency_samples[latency_count - 1] * 1e3,
+                latency_count);
+    }
+    if (keys_dropped) fprintf(stderr, "keys dropped: %ld\n", keys_dropped);
+    for (int i = 0; i < NUM_PHASES; i++) {
+        if (phase_wall[i] <= 0) continue;
+        fprintf(stderr, "cpu %s: %.2f%% of %.1f s\n", phase_names[i],
+                100.0 * phase_cpu[i] / phase_wall[i], phase_wall[i]);
     }
-    state->next_shape = shapes[rand() % NUM_SHAPES];
-    state->hold_used = 0;
 }
 
 void render(GameState *state) {
-    int y_offset = (height / 2) - (BOARD_HEIGHT * 0.5) + 3;
-    int x_offset = (width / 2) - (BOARD_WIDTH * BLOCK_MULT_X * 0.5);
-
-    for (int i = 0; i < BOARD_HEIGHT + 2; i++) {
-        if (i <= BOARD_HEIGHT) {
-            printf("\e[%d;%dH\e[32m%s",
-                   (i + 1) + y_offset, 
-                   x_offset,
-                   "<!");
-            printf("\e[%d;%dH\e[32m%s",
-                   (i + 1) + y_offset, 
-                   x_offset + BOARD_WIDTH * BLOCK_MULT_X + 2,
-                   "!>");
+    int y_offset = (height / 2) - (state->height * 0.5) + 3;
+    int x_offset = (width / 2) - (state->width * BLOCK_MULT_X * 0.5);
+
+    // Clearing rows blink, hidden on every other flash phase
+    uint64_t hidden_rows = 0;
+    if ((state->clear_frame / CLEAR_FLASH_FRAMES) % 2 == 0) {
+        hidden_rows = tetris_clearing_rows(state);
+    }
+
+    for (int i = 0; i < state->height + 2; i++) {
+        if (i <= state->height) {
+            draw((i + 1) + y_offset,
+                 x_offset,
+                 "<!");
+            draw((i + 1) + y_offset,
+                 x_offset + state->width * BLOCK_MULT_X + 2,
+                 "!>");
         }
-        for (int j = 0; j < BOARD_WIDTH; j++) {
-            if (i == BOARD_HEIGHT) {
-                printf("\e[%d;%dH\e[32m%s",
-                       (i + 1) + y_offset, 
-                       (j + 1) * BLOCK_MULT_X + x_offset, 
-                       "==");
-            } else if (i == BOARD_HEIGHT + 1) {
-                printf("\e[%d;%dH\e[32m%s",
-                       (i + 1) + y_offset, 
-                       (j + 1) * BLOCK_MULT_X + x_offset, 
-                       "\\/");
+        for (int j = 0; j < state->width; j++) {
+            if (i == state->height) {
+                draw((i + 1) + y_offset,
+                     (j + 1) * BLOCK_MULT_X + x_offset,
+                     "==");
+            } else if (i == state->height + 1) {
+                draw((i + 1) + y_offset,
+                     (j + 1) * BLOCK_MULT_X + x_offset,
+                     "\\/");
             } else {
-                if (state->board[i][j]) {
-                    printf("\e[%d;%dH\e[32m%s",
-                           (i + 1) + y_offset, 
-                           (j + 1) * BLOCK_MULT_X + x_offset, 
-                           "[]");
+                if (state->board[i] & CELL_BIT(j) && !(hidden_rows & (1ull << i))) {
+                    draw((i + 1) + y_offset,
+                         (j + 1) * BLOCK_MULT_X + x_offset,
+                         "[]");
                 } else {
-                    printf("\e[%d;%dH\e[32m%s",
-                           (i + 1) + y_offset, 
-                           (j + 1) * BLOCK_MULT_X + x_offset, 
-                           " .");
+                    draw((i + 1) + y_offset,
+                         (j + 1) * BLOCK_MULT_X + x_offset,
+                         " .");
                 }
             }
         }
     }
 
+    // The piece is already locked into the board while rows clear
+    if (state->clearing) return;
+
     ActivePiece *piece = &state->active_piece;
-    Shape *shape = piece->type;
+    const Shape *shape = PIECE_SHAPE(piece);
 
     for (int y = 0; y < shape->height; y++) {
         for (int x = 0; x < shape->width; x++) {
-            if (shape->shape[y * shape->width + x]) {
-                printf("\e[%d;%dH\e[32m%s",
-                       (piece->y + 1 + y) + y_offset,
-                       (piece->x + 1 + x) * BLOCK_MULT_X + x_offset,
-                       "[]");
+            if (shape->rows[y] & (1 << x)) {
+                draw((piece->y + 1 + y) + y_offset,
+                     (piece->x + 1 + x) * BLOCK_MULT_X + x_offset,
+                     "[]");
             }
         }
     }
 }
 
-void free_shapes() {
-    for (int i = 0; i < NUM_SHAPES; i++) {
-        free(shapes[i]);
-    }
-}
-
 void handle_sigint(int sig) {
-    if (g_piece && g_piece->type) {
-        free(g_piece->type->shape);
-        free(g_piece->type);
-        g_piece->type = NULL;
-    }
-    free_shapes();
     reset_terminal();
     exit(0);
 }
 
-int check_fall(GameState *state) {
-    ActivePiece *piece = &state->active_piece;
-    Shape *shape = piece->type;
-
-    for (int y = 0; y < shape->height; y++) {
-        for (int x = 0; x < shape->width; x++) {
-            if (!shape->shape[y * shape->width + x]) {
-                continue;
-            }
-            if (piece->y + y == BOARD_HEIGHT - 1) {
-                return 0;
-            }
-            if (state->board[piece->y + y + 1][piece->x + x]) {
-                return 0;
-            }
-        }
-    }
-    return 1;
-}
-
-void hard_drop(GameState *state) {
-    while (check_fall(state)) {
-        state->active_piece.y++;
-    }
-}
-
-void try_move(GameState *state, int dir) {
-    ActivePiece *piece = &state->active_piece;
-    Shape *shape = piece->type;
-
-    for (int y = 0; y < shape->height; y++) {
-        for (int x = 0; x < shape->width; x++) {
-            if (!shape->shape[y * shape->width + x]) {
-                continue;
-            }
-            if (dir == 1) {
-                if (piece->x + x == BOARD_WIDTH - 1) {
-                    return;
-                }
-            } else {
-                if (piece->x == 0) {
-                    return;
-                }
-            }
-            if (state->board[piece->y + y][piece->x + x + dir]) {
-                return;
-            }
-        }
-    }
-    piece->x += dir;
-}
-
-void update_state(GameState *state) {
-    ActivePiece *piece = &state->active_piece;
-    Shape *shape = piece->type;
-    for (int y = 0; y < shape->height; y++) {
-        for (int x = 0; x < shape->width; x++) {
-            if (shape->shape[y * shape->width + x]) {
-                state->board[piece->y+y][piece->x+x] = 1;
-            }
-        }
-    }
-}
-
 void debug(GameState *state) {
     ActivePiece *piece = &state->active_piece;
-    for (int i = 0; i < BOARD_HEIGHT; i++) {
-        for (int j = 0; j < BOARD_WIDTH; j++) {
-            printf("\e[%d;%dH%i", i, j, state->board[i][j]);
+    for (int i = 0; i < state->height; i++) {
+        for (int j = 0; j < state->width; j++) {
+            printf("\e[%d;%dH%i", i, j, !!(state->board[i] & CELL_BIT(j)));
         }
     }
-    Shape *shape = piece->type;
+    const Shape *shape = PIECE_SHAPE(piece);
     for (int y = 0; y < shape->height; y++) {
         for (int x = 0; x < shape->width; x++) {
-            uint8_t val = shape->shape[y * shape->width + x] * 2;
+            uint8_t val = (shape->rows[y] >> x & 1) * 2;
             if (val != 0) {
                 printf("\e[%d;%dH%u",
                        piece->y + y,
@@ -368,443 +435,335 @@ void debug(GameState *state) {
             }
         }
     }
-    printf("\e[%d;%dH(%i,%i)", BOARD_HEIGHT+1, 1, piece->y, piece->x);
+    printf("\e[%d;%dH(%i,%i)", state->height+1, 1, piece->y, piece->x);
 }
 
-void rotate_shape(GameState *state) {
-    ActivePiece *piece = &state->active_piece;
-    Shape *shape = piece->type;
-    int new_w = shape->height;
-    int new_h = shape->width;
-
-    uint8_t rotated[new_h * new_w];
-
-    for (int y = 0; y < shape->height; y++) {
-        for (int x = 0; x < shape->width; x++) {
-            rotated[x * new_w + (new_w - 1 - y)] = shape->shape[y * shape->width + x];
-        }
-    }
-
-    for (int y = 0; y < new_h; y++) {
-        for (int x = 0; x < new_w; x++) {
-            if (!rotated[y * new_w + x])
-                continue;
-
-            int new_x = piece->x + x;
-            int new_y = piece->y + y;
-
-            if (new_x < 0 || new_x >= BOARD_WIDTH || new_y < 0 || new_y >= BOARD_HEIGHT)
-                return;
-
-            if (state->board[new_y][new_x])
-                return;
+// Draw a piece preview in its spawn rotation, id < 0 draws nothing
+void render_preview(int id, int y_offset, int x_offset) {
+    if (id < 0) return;
+    const Shape *shape = &tetris_piece_table[id][0];
+    for (int i = 0; i < shape->height; i++) {
+        for (int j = 0; j < shape->width; j++) {
+            draw(y_offset + i,
+                 x_offset + (j * BLOCK_MULT_X),
+                 shape->rows[i] & (1 << j) ? "[]" : "  ");
         }
     }
+}
 
-    for (int i = 0; i < shape->width * shape->height; i++)
-        shape->shape[i] = rotated[i];
+void render_hold(GameState *state) {
+    int y_offset = (height / 2) - (state->height * 0.5) + 1 + 3;
+    int x_offset = (width / 2) - (state->width * BLOCK_MULT_X * 0.5) - 10;
 
-    shape->width = new_w;
-    shape->height = new_h;
+    draw(y_offset-2, x_offset-1, "HOLD");
+    render_preview(state->hold_id, y_offset, x_offset);
 }
 
-void swap_shape(GameState *state) {
-    ActivePiece *piece = &state->active_piece;
-    Shape *shape = &state->hold_shape;
-    Shape *temp_src = piece->src_type;
-    piece->src_type = shape;
+void render_next_piece(GameState *state) {
+    int y_offset = (height / 2) - (state->height * 0.5) + 1 + 3;
+    int x_offset = (width / 2) + (state->width * BLOCK_MULT_X * 0.5) + 10;
 
-    free(piece->type->shape);
-    piece->type->width = shape->width;
-    piece->type->height = shape->height;
-    int size = shape->width * shape->height;
-    piece->type->shape = malloc(sizeof(uint8_t) * size);
-    memcpy(piece->type->shape, shape->shape, sizeof(uint8_t) * size);
+    draw(y_offset-2, x_offset-1, "NEXT");
+    render_preview(state->next_id, y_offset, x_offset);
+}
 
-    piece->x = BOARD_WIDTH / 2 - piece->type->width / 2;
-    piece->y = 0;
+void render_score(GameState *state) {
+    char text[32];
+    snprintf(text, sizeof(text), "LEVEL: %d", tetris_level(state));
+    draw(4, width / 2 - 7, text);
+    snprintf(text, sizeof(text), "SCORE: %d", state->score);
+    draw(3, width/2 - 7, text);
+}
 
-    shape->shape = temp_src->shape;
-    shape->width = temp_src->width;
-    shape->height = temp_src->height;
+void render_game_over(GameState *state) {
+    draw( 6, width / 2 - 14/2 + 2, "==============");
+    draw( 7, width / 2 - 14/2 + 2, "| GAME OVER! |");
+    draw( 8, width / 2 - 14/2 + 2, "==============");
+    draw(10, width / 2 - 18/2 + 2, "Press R to Restart");
+    draw(11, width / 2 - 12/2 + 2, "or Q to Quit");
+    if (undo_depth > 0) draw(12, width / 2 - 12/2 + 2, "or U to Undo");
 }
 
-void hold(GameState *state) {
-    ActivePiece *piece = &state->active_piece;
-    Shape *hold_shape = &state->hold_shape;
-    if (state->hold_used) return;
+void shift_release() {
+    shift.cmd = CMD_TICK;
+    shift.armed = shift.held = 0;
+}
 
-    if (hold_shape->shape == NULL) {
-        hold_shape->shape = piece->src_type->shape;
-        hold_shape->width = piece->src_type->width;
-        hold_shape->height = piece->src_type->height;
+void push_undo(GameState *state) {
+    if (undo_depth < 1) return;
+    GameSnapshot *snap = snapshot_push(&undo_ring, state);
+    undo_marks[snap - undo_ring.slots] = (ReplayMark){replay.len, replay.inputs, replay.frames, replay.last_frame};
+}
 
-        spawn_piece(state);
-    } else {
-        swap_shape(state);
+// Back to when the previous piece came in, or after a game over to when the
+// piece that topped out did. The recording loses what was undone.
+void undo_piece(GameState *state) {
+    int back = state->game_over ? 0 : 1;
+    if (back >= undo_ring.count) back = undo_ring.count - 1;
+    GameSnapshot *snap = snapshot_rollback(&undo_ring, back, state);
+    if (!snap) return;
+    if (record_path) {
+        ReplayMark *mark = &undo_marks[snap - undo_ring.slots];
+        replay.len = mark->len;
+        replay.inputs = mark->inputs;
+        replay.frames = mark->frames;
+        replay.last_frame = mark->last_frame;
     }
-    state->hold_used = 1;
+    plan_len = plan_pos = 0;
+    shift_release();
 }
 
-void render_hold(GameState *state) {
-    int y_offset = (height / 2) - (BOARD_HEIGHT * 0.5) + 1 + 3;
-    int x_offset = (width / 2) - (BOARD_WIDTH * BLOCK_MULT_X * 0.5) - 10;
-
-    Shape *shape = &state->hold_shape;
-
-    printf("\e[%d;%dH%s", y_offset-2, x_offset-1, "HOLD");
-
-    if (!shape || !shape->shape) return;
-    for (int i = 0; i < shape->height; i++) {
-        for (int j = 0; j < shape->width; j++) {
-            printf("\e[%d;%dH%s",
-                   y_offset + i,
-                   x_offset + (j * BLOCK_MULT_X),
-                   shape->shape[i * shape->width + j] ? "[]" : "  ");
-        }
+// Every command reaches the game through here so --record sees it, and
+// every new piece gets an undo snapshot
+void play_command(GameState *state, Command cmd) {
+    if (record_path) replay_record(&replay, cmd);
+    uint32_t pieces = state->pieces;
+    tetris_command(state, cmd);
+    if (state->pieces != pieces && !state->game_over) {
+        push_undo(state);
     }
 }
 
-void render_next_piece(GameState *state) {
-    int y_offset = (height / 2) - (BOARD_HEIGHT * 0.5) + 1 + 3;
-    int x_offset = (width / 2) + (BOARD_WIDTH * BLOCK_MULT_X * 0.5) + 10;
-
-    Shape *shape = state->next_shape;
-
-    printf("\e[%d;%dH%s", y_offset-2, x_offset-1, "NEXT");
-
-    if (!shape || !shape->shape) return;
-    for (int i = 0; i < shape->height; i++) {
-        for (int j = 0; j < shape->width; j++) {
-            printf("\e[%d;%dH%s",
-                   y_offset + i,
-                   x_offset + (j * BLOCK_MULT_X),
-                   shape->shape[i * shape->width + j] ? "[]" : "  ");
-        }
-    }
+// Write out the recorded game, the file ends up holding the last one played
+void save_replay(GameState *state) {
+    if (!record_path || replay.frames == 0) return;
+    replay_finish(&replay, state);
+    if (!replay_save(&replay, record_path)) fprintf(stderr, "can't write replay %s\n", record_path);
 }
 
-void render_score(GameState *state) {
-    printf("\e[%d;%dHLEVEL: %d", 4, width / 2 - 7, state->level);
-    printf("\e[%d;%dHSCORE: %d", 3, width/2 - 7, state->score);
+// Fresh game for the terminal, with the clear animation on
+void new_game(GameState *state) {
+    uint64_t seed = (uint64_t)time(NULL) ^ (uint64_t)getpid() << 32;
+    if (record_path) save_replay(state);
+    tetris_init_game_sized(state, seed, board_width, board_height);
+    tetris_set_events(state, &game_events);
+    state->animate_clears = 1;
+    if (record_path) replay_begin(&replay, state, seed);
+    plan_len = plan_pos = 0;
+    shift_release();
+    snapshot_ring_clear(&undo_ring);
+    push_undo(state);
 }
 
-void render_game_over(GameState *state) {
-    printf("\e[%d;%dH%s",  6, width / 2 - 14/2 + 2, "==============");
-    printf("\e[%d;%dH%s",  7, width / 2 - 14/2 + 2, "| GAME OVER! |");
-    printf("\e[%d;%dH%s",  8, width / 2 - 14/2 + 2, "==============");
-    printf("\e[%d;%dH%s", 10, width / 2 - 18/2 + 2, "Press R to Restart");
-    printf("\e[%d;%dH%s", 11, width / 2 - 12/2 + 2, "or Q to Quit");
-}
-
-int check_clear(GameState *state) {
-    int cleared = 0;
-    int full_rows[BOARD_HEIGHT];
-    int full_count = 0;
-
-    // detect all full rows
-    for (int i = 0; i < BOARD_HEIGHT; i++) {
-        int full = 1;
-        for (int j = 0; j < BOARD_WIDTH; j++) {
-            if (!state->board[i][j]) {
-                full = 0;
-                break;
-            }
-        }
-        if (full) {
-            full_rows[full_count++] = i;
-        }
+// Read the engine's events. A lock ends the bot's plan, and when a key
+// (read at key_time) caused it the latency clock starts. Everything else
+// drains with key_time 0 straight after it plays, so the queue is empty
+// whenever a key's command runs and a lock found after it is that key's.
+void drain_events(GameState *state, double key_time) {
+    Event event;
+    while (tetris_poll_event(state, &event)) {
+        if (event.type != EVENT_LOCK) continue;
+        plan_len = plan_pos = 0;
+        if (key_time > 0) lock_key_time = key_time;
     }
+}
 
-    if (full_count == 0)
-        return 0;
-
-    // animate clearing all full rows
-    for (int flash = 0; flash < 2; flash++) {
-
-        // hide rows
-        for (int i = 0; i < full_count; i++) {
-            int row = full_rows[i];
-            for (int j = 0; j < BOARD_WIDTH; j++) {
-                state->board[row][j] = 0;
-            }
-        }
-
-        printf("\e[2J\e[H");
-        render_hold(state);
-        render_next_piece(state);
-        render_score(state);
-        render(state);
-        fflush(stdout);
-
-        usleep(120000); // 120 ms flash
-
-        // restore rows
-        for (int i = 0; i < full_count; i++) {
-            int row = full_rows[i];
-            for (int j = 0; j < BOARD_WIDTH; j++) {
-                state->board[row][j] = 1; // or store original color if you have that
+// Left/right press. Terminals send no key releases, only the OS auto-repeat
+// while a key is down: one press, a pause of the keyboard's repeat delay,
+// then presses closer than release_ms. Once that pattern shows up the key
+// counts as held, until the repeats stop. While it's held the game shifts by
+// itself, das_ms after the chain's first press and then every arr_ms
+// (0 = straight to the wall), in place of the OS repeat rate. Quick taps
+// never follow a repeat-delay pause, so each one still moves.
+void shift_press(GameState *state, Command cmd, double time) {
+    double gap = time - shift.last;
+    if (shift.cmd == cmd && gap < SHIFT_CHAIN_GAP) {
+        if (shift.armed && gap < release_ms / 1e3) {
+            if (!shift.held) {
+                shift.held = 1;
+                double das = shift.start + das_ms / 1e3;
+                shift.next_shift = das > time ? das : time;
             }
+            shift.last = time;
+            return; // an OS repeat, auto_shift() does the moving
         }
-
-        printf("\e[2J\e[H");
-        render_hold(state);
-        render_next_piece(state);
-        render_score(state);
-        render(state);
-        fflush(stdout);
-
-        usleep(120000);
+        shift.armed = gap >= REPEAT_DELAY_MIN && shift.last == shift.start;
+    } else {
+        shift = (ShiftState){cmd, time, time, 0, 0, 0};
     }
+    shift.last = time;
+    play_command(state, cmd);
+    drain_events(state, time);
+}
 
-    // collapse
-    int write_row = BOARD_HEIGHT - 1;
-
-    for (int read_row = BOARD_HEIGHT - 1; read_row >= 0; read_row--) {
-        // skip cleared rows
-        int is_full = 0;
-        for (int k = 0; k < full_count; k++) {
-            if (full_rows[k] == read_row) {
-                is_full = 1;
-                break;
-            }
-        }
-        if (!is_full) {
-            // copy row downward
-            if (write_row != read_row) {
-                for (int j = 0; j < BOARD_WIDTH; j++) {
-                    state->board[write_row][j] = state->board[read_row][j];
-                }
-            }
-            write_row--;
-        }
+void auto_shift(GameState *state, double now) {
+    if (!shift.held) return;
+    if (now - shift.last > release_ms / 1e3) {
+        shift_release();
+        return;
     }
-
-    // fill remaining top rows with zeros
-    for (int r = write_row; r >= 0; r--) {
-        for (int j = 0; j < BOARD_WIDTH; j++) {
-            state->board[r][j] = 0;
-        }
+    // Stop at the wall (or a stack in the way) rather than shifting into it
+    // the whole width every frame
+    for (int moves = 0; now >= shift.next_shift && moves < state->width; moves++) {
+        int x = state->active_piece.x;
+        play_command(state, shift.cmd);
+        if (arr_ms > 0) shift.next_shift += arr_ms / 1e3;
+        if (state->active_piece.x == x) break;
     }
-
-    return full_count;
 }
 
-int calculate_score(int lvl, int lines_cleared) {
-    switch (lines_cleared) {
-        case 1: return 40 * (lvl + 1);
-        case 2: return 100 * (lvl + 1);
-        case 3: return 300 * (lvl + 1);
-        case 4: return 1200 * (lvl + 1);
-        default: return 0;
+// Play the next command of the bot's plan, planning when there is none.
+// A piece that locked early (gravity got there first) drops what's left.
+void autoplay_step(GameState *state) {
+    drain_events(state, 0);
+    if (state->clearing || state->game_over) return;
+    if (plan_pos == plan_len) {
+        Placement move;
+        if (!bot_choose(&bot, state, &move)) return;
+        plan_len = bot_placement_commands(&move, plan);
+        plan_pos = 0;
     }
+    play_command(state, plan[plan_pos++]);
 }
 
-void add_lines(GameState *state, int cleared) {
-    state->total_lines += cleared;
-    state->score += calculate_score(state->level, cleared);
-
-    int start_level = 0; // TEMP
-    int new_level = start_level + state->total_lines / 10;
-    if (new_level > state->level) {
-        state->level = new_level;
-        update_speed(state);
+int main(int argc, char **argv) {
+    int depth = 2, beam = 8;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) stats_enabled = 1;
+        else if (strcmp(argv[i], "--auto") == 0) autoplay = 1;
+        else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--beam") == 0 && i + 1 < argc) beam = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) record_path = argv[++i];
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) sscanf(argv[++i], "%dx%d", &board_width, &board_height);
+        else if (strcmp(argv[i], "--das") == 0 && i + 1 < argc) das_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--arr") == 0 && i + 1 < argc) arr_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--release") == 0 && i + 1 < argc) release_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--undo") == 0 && i + 1 < argc) undo_depth = atoi(argv[++i]);
     }
-}
-
-void initialize_game_state(GameState *state) {
-    // Clear board
-    memset(state->board, 0, sizeof(state->board));
-
-    // Reset hold shape
-    state->hold_shape = (Shape){0}; // shape=NULL, width=0, height=0
-    //
-    if (state->active_piece.type != NULL) {
-        free(state->active_piece.type->shape);
-        free(state->active_piece.type);
+    if (undo_depth > 0) {
+        snapshot_ring_init(&undo_ring, undo_depth);
+        undo_marks = malloc(undo_ring.depth * sizeof(ReplayMark));
     }
+    if (autoplay) bot_init(&bot, threads, depth, beam, bot_default_weights);
 
-    // Reset active piece
-    state->active_piece.type = NULL;
-    state->active_piece.src_type = NULL;
-    state->active_piece.x = 0;
-    state->active_piece.y = 0;
-
-
-    // Reset counters and flags
-    state->total_lines = 0;
-    state->score = 0;
-    state->level = 0;
-    state->running = 1;
-    state->pause = 0;
-    state->hold_used = 0;
-    state->game_over = 0;
-    state->speed = 48; // DAS version initial speed for lvl 00
-
-    state->next_shape = shapes[rand() % NUM_SHAPES];
-    // Spawn first piece
-    spawn_piece(state);
-}
-
-int main() {
-    srand(time(NULL));
     configure_terminal();
     struct winsize w;
     ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
     width = w.ws_col;
     height = w.ws_row;
-
-    initialize_shapes(shapes);
+    fb_init(width, height);
+    sync_output = terminal_has_sync();
 
     GameState gameState;
-    initialize_game_state(&gameState);
-    g_piece = &gameState.active_piece;
+    new_game(&gameState);
+    int running = 1;
+    int pause = 0;
 
     signal(SIGINT, handle_sigint);
-    double prev_time = get_time_seconds();
-    int frame_count = 0;
-    int prev_frame_count = 0;
-
-    while (gameState.running) {
-        double now = get_time_seconds();
-        if (now - prev_time < 1.0/FPS) {
-            usleep(1000); // sleep 1 ms
-            continue;
+    key_event_fd = eventfd(0, EFD_CLOEXEC);
+    pthread_t input_thread;
+    pthread_create(&input_thread, NULL, input_main, NULL);
+    pthread_detach(input_thread); // left blocked in read() at exit
+    double next_frame = get_time_seconds();
+
+    while (running) {
+        int phase = gameState.game_over ? PHASE_OVER : pause ? PHASE_PAUSED : PHASE_PLAY;
+        if (phase == PHASE_PLAY && current_phase != PHASE_PLAY) {
+            next_frame = get_time_seconds(); // back from a pause or a restart
         }
+        enter_phase(phase);
+
+        if (phase == PHASE_PLAY) {
+            record_jitter(sleep_until(next_frame));
+            next_frame += 1.0 / FPS;
+            double now = get_time_seconds();
+            if (next_frame < now) { // fell a whole frame behind, don't try to catch up
+                next_frame = now + 1.0 / FPS;
+                missed_frames++;
+            }
+        } else if (phase == PHASE_OVER) {
+            // Overlay on the last board frame, the diff sends it once and
+            // nothing changes until a key comes in
+            frame_repaint_bytes = 0;
+            render_game_over(&gameState);
+            end_frame();
+            wait_for_key();
+        } else {
+            wait_for_key();
+        }
+
+        KeyEvent key;
         if (!gameState.game_over) {
-            if (gameState.pause) {
-                if (kbhit()) {
-                    char seq[1];
-                    read(STDIN_FILENO, &seq[0], 1);
-                    switch (seq[0]) {
+            if (pause) {
+                while (pause && running && key_pop(&key)) {
+                    switch (key.key) {
                         case 'q': // Quit
-                            gameState.running = 0;
+                            running = 0;
                             break;
                         case 'r': // Restart
-                            initialize_game_state(&gameState);
+                            new_game(&gameState);
                             break;
-                        case '\e':
+                        case KEY_ESCAPE:
                         case 'p': // Puase
-                            gameState.pause = !gameState.pause;
+                            pause = !pause;
                             break;
                     }
                 }
                 continue;
             }
-            frame_count++;
-            prev_time = get_time_seconds();
-            if (kbhit()) {
-                char seq[3];
-                read(STDIN_FILENO, &seq[0], 1);
-                if (seq[0] == '\e') { // Escape sequence
-                    // Check if the next two bytes exist
-                    if (read(STDIN_FILENO, &seq[1], 1) > 0 && seq[1] == '[') {
-                        if (read(STDIN_FILENO, &seq[2], 1) > 0) {
-                            switch (seq[2]) {
-                                case 'A': // Up: rotate
-                                    rotate_shape(&gameState);
-                                    break;
-                                case 'B': // Down
-                                    if (check_fall(&gameState)) {
-                                        gameState.active_piece.y++;
-                                    } else {
-                                        update_state(&gameState);
-                                        spawn_piece(&gameState);
-                                    }
-                                    break;
-                                case 'C': // Right
-                                    try_move(&gameState, 1);
-                                    break;
-                                case 'D': // Left
-                                    try_move(&gameState, -1);
-                                    break;
-                            }
-                        }
-                    } else {
-                        gameState.pause = !gameState.pause;
-                        continue;
-                    }
-                } else {
-                    switch (seq[0]) {
-                        case 'q': // Quit
-                            gameState.running = 0;
-                            break;
-                        case 'w':
-                        case 'k': // Rotate
-                            rotate_shape(&gameState);
-                            break;
-                        case 'l': // Right
-                            try_move(&gameState, 1);
-                            break;
-                        case 'h': // Left
-                            try_move(&gameState, -1);
-                            break;
-                        case 'j': // Down
-                            if (check_fall(&gameState)) {
-                                gameState.active_piece.y++;
-                            } else {
-                                update_state(&gameState);
-                                spawn_piece(&gameState);
-                            }
-                            break;
-                        case ' ': // Full down
-                            hard_drop(&gameState);
-                            update_state(&gameState);
-                            spawn_piece(&gameState);
-                            break;
-                        case 'c': // Hold
-                            hold(&gameState);
-                            break;
-                        case 'r': // Restart
-                            initialize_game_state(&gameState);
-                            break;
-                        case 'p': // Puase
-                            gameState.pause = !gameState.pause;
-                            break;
-                    }
+            // The whole queue each frame; keys typed during a clear wait for it to end
+            while (!gameState.clearing && !pause && running && key_pop(&key)) {
+                int cmd = key_command(key.key);
+                if (cmd == CMD_LEFT || cmd == CMD_RIGHT) {
+                    shift_press(&gameState, cmd, key.time);
+                } else if (cmd >= 0) {
+                    play_command(&gameState, cmd);
+                    drain_events(&gameState, key.time);
+                } else if (key.key == 'q') { // Quit
+                    running = 0;
+                } else if (key.key == 'r') { // Restart
+                    new_game(&gameState);
+                } else if (key.key == 'u') { // Undo
+                    undo_piece(&gameState);
+                } else if (key.key == 'p' || key.key == KEY_ESCAPE) { // Pause
+                    pause = !pause;
+                    shift_release();
                 }
             }
-            if (gameState.pause) continue;
+            if (pause || !running) continue;
 
-            printf("\e[2J\e[H"); // clear terminal
-            if (frame_count - prev_frame_count > gameState.speed) {
-                prev_frame_count = frame_count;
-                if (check_fall(&gameState)) {
-                    gameState.active_piece.y++;
-                }
-                else {
-                    update_state(&gameState);
-                    spawn_piece(&gameState);
-                }
-                add_lines(&gameState, check_clear(&gameState));
-            }
+            begin_frame();
+            if (!gameState.clearing) auto_shift(&gameState, get_time_seconds());
+            if (autoplay) autoplay_step(&gameState);
+            play_command(&gameState, CMD_TICK);
+            drain_events(&gameState, 0); // gravity locks aren't any key's doing
             render_hold(&gameState);
             render_next_piece(&gameState);
             render_score(&gameState);
             render(&gameState);
-            fflush(stdout);
+            end_frame();
+            if (lock_key_time > 0) {
+                record_latency(get_time_seconds() - lock_key_time);
+                lock_key_time = 0;
+            }
         } else {
-            if (kbhit()) {
-                char seq[3];
-                read(STDIN_FILENO, &seq[0], 1);
-                switch (seq[0]) {
+            while (gameState.game_over && running && key_pop(&key)) {
+                switch (key.key) {
                     case 'q':
-                        gameState.running = 0;
+                        running = 0;
                         break;
                     case 'r':
-                        initialize_game_state(&gameState);
+                        new_game(&gameState);
+                        break;
+                    case 'u':
+                        undo_piece(&gameState);
                         break;
                 }
             }
-            render_game_over(&gameState);
         }
         // debug(&gameState);
     }
-    if (gameState.active_piece.type) {
-        free(gameState.active_piece.type->shape);
-        free(gameState.active_piece.type);
-    }
+    enter_phase(-1);
     reset_terminal();
-    free_shapes();
+    save_replay(&gameState);
+    replay_free(&replay);
+    snapshot_ring_free(&undo_ring);
+    free(undo_marks);
+    fb_free();
+    if (autoplay) bot_free(&bot);
+    if (stats_enabled) print_stats();
+    free(latency_samples);
     return 0;
 }
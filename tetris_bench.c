@@ -0,0 +1,679 @@
+// Headless tetris benchmark: games/s and pieces/s from tetris_engine.h on
+// one core and on all of them, the placement bot's search speed, and the
+// bitboard microbenchmarks, the size-specialized kernels against the generic
+// one, replaying recorded games, and snapshot save/restore.
+//
+//   cc -O2 tetris_bench.c -o tetris_bench -lpthread
+//   ./tetris_bench [--games N] [--threads N] [--seed N] [--size WxH] [--ops [iters]]
+//   ./tetris_bench --kernels [--games N] [--seed N]
+//   ./tetris_bench --bot [--depth N] [--beam N] [--pieces N] [--games N] [--threads N]
+//                  [--size WxH] [--record FILE]
+//   ./tetris_bench --replay FILE [--repeat N]
+//   ./tetris_bench --snapshots [iters] [--seed N]
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tetris_engine.h"
+#include "tetris_bot.h"
+#include "tetris_replay.h"
+#include "tetris_snapshot.h"
+
+double get_time_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Heap allocations made by the process, the game loop itself should make none.
+// Counted by wrapping the glibc allocator, elsewhere it just stays at 0.
+// Worker threads allocate too, so the count is atomic; relaxed is enough since
+// it is only read after the threads are joined.
+_Atomic long alloc_count = 0;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+// Microbenchmark: the bitboard against the previous int board[][] code
+
+typedef struct {
+    int width, height;
+    uint8_t shape[MAX_SHAPE * MAX_SHAPE];
+} CellShape;
+
+typedef struct {
+    int cells[BOARD_HEIGHT][BOARD_WIDTH];
+    CellShape piece;
+    int x, y;
+} CellBoard;
+
+// Load a table rotation into the byte-per-cell layout the old code used
+void cell_set_piece(CellBoard *b, const Shape *shape) {
+    b->piece.width = shape->width;
+    b->piece.height = shape->height;
+    for (int y = 0; y < shape->height; y++) {
+        for (int x = 0; x < shape->width; x++) {
+            b->piece.shape[y * shape->width + x] = shape->rows[y] >> x & 1;
+        }
+    }
+}
+
+int cell_check_fall(CellBoard *b) {
+    CellShape *shape = &b->piece;
+    for (int y = 0; y < shape->height; y++) {
+        for (int x = 0; x < shape->width; x++) {
+            if (!shape->shape[y * shape->width + x]) continue;
+            if (b->y + y == BOARD_HEIGHT - 1) return 0;
+            if (b->cells[b->y + y + 1][b->x + x]) return 0;
+        }
+    }
+    return 1;
+}
+
+void cell_try_move(CellBoard *b, int dir) {
+    CellShape *shape = &b->piece;
+    for (int y = 0; y < shape->height; y++) {
+        for (int x = 0; x < shape->width; x++) {
+            if (!shape->shape[y * shape->width + x]) continue;
+            if (dir == 1) {
+                if (b->x + x == BOARD_WIDTH - 1) return;
+            } else {
+                if (b->x == 0) return;
+            }
+            if (b->cells[b->y + y][b->x + x + dir]) return;
+        }
+    }
+    b->x += dir;
+}
+
+void cell_rotate(CellBoard *b) {
+    CellShape *shape = &b->piece;
+    int new_w = shape->height;
+    int new_h = shape->width;
+    uint8_t rotated[new_h * new_w];
+    for (int y = 0; y < shape->height; y++) {
+        for (int x = 0; x < shape->width; x++) {
+            rotated[x * new_w + (new_w - 1 - y)] = shape->shape[y * shape->width + x];
+        }
+    }
+    for (int y = 0; y < new_h; y++) {
+        for (int x = 0; x < new_w; x++) {
+            if (!rotated[y * new_w + x]) continue;
+            int nx = b->x + x, ny = b->y + y;
+            if (nx < 0 || nx >= BOARD_WIDTH || ny < 0 || ny >= BOARD_HEIGHT) return;
+            if (b->cells[ny][nx]) return;
+        }
+    }
+    memcpy(shape->shape, rotated, new_w * new_h);
+    shape->width = new_w;
+    shape->height = new_h;
+}
+
+void cell_lock(CellBoard *b) {
+    CellShape *shape = &b->piece;
+    for (int y = 0; y < shape->height; y++) {
+        for (int x = 0; x < shape->width; x++) {
+            if (shape->shape[y * shape->width + x]) b->cells[b->y + y][b->x + x] = 1;
+        }
+    }
+}
+
+int cell_clear(CellBoard *b) {
+    int full_rows[BOARD_HEIGHT];
+    int full_count = 0;
+    for (int i = 0; i < BOARD_HEIGHT; i++) {
+        int full = 1;
+        for (int j = 0; j < BOARD_WIDTH; j++) {
+            if (!b->cells[i][j]) {
+                full = 0;
+                break;
+            }
+        }
+        if (full) full_rows[full_count++] = i;
+    }
+    if (full_count == 0) return 0;
+
+    int write_row = BOARD_HEIGHT - 1;
+    for (int read_row = BOARD_HEIGHT - 1; read_row >= 0; read_row--) {
+        int is_full = 0;
+        for (int k = 0; k < full_count; k++) {
+            if (full_rows[k] == read_row) {
+                is_full = 1;
+                break;
+            }
+        }
+        if (!is_full) {
+            if (write_row != read_row) {
+                for (int j = 0; j < BOARD_WIDTH; j++) b->cells[write_row][j] = b->cells[read_row][j];
+            }
+            write_row--;
+        }
+    }
+    for (int r = write_row; r >= 0; r--) {
+        for (int j = 0; j < BOARD_WIDTH; j++) b->cells[r][j] = 0;
+    }
+    return full_count;
+}
+
+void print_bench(const char *name, double old_s, double new_s, long iters) {
+    printf("%-12s %8.2f ns  %8.2f ns  %6.1fx\n", name,
+           old_s * 1e9 / iters, new_s * 1e9 / iters, old_s / new_s);
+}
+
+int run_ops(long iters) {
+    tetris_init_tables();
+    GameState state;
+    CellBoard cells;
+
+    // Ragged stack with a few nearly complete rows, same in both boards
+    tetris_init_game(&state, 1);
+    memset(cells.cells, 0, sizeof(cells.cells));
+    for (int i = 8; i < BOARD_HEIGHT; i++) {
+        for (int j = 0; j < BOARD_WIDTH; j++) {
+            int filled = i >= BOARD_HEIGHT - 2 ? j != 4 : rand() % 3 != 0;
+            if (i < 12 && rand() % 2) filled = 0;
+            if (!filled) continue;
+            state.board[i] |= CELL_BIT(j);
+            cells.cells[i][j] = 1;
+        }
+    }
+    GameState state_template = state;
+    CellBoard cells_template = cells;
+
+    // Vertical I dropped into the well clears the two bottom rows
+    state.active_piece = (ActivePiece){4, 1, 4, 4};
+    cell_set_piece(&cells, PIECE_SHAPE(&state.active_piece));
+    cells.x = 4;
+    cells.y = 4;
+
+    double t0, t_old, t_new;
+    long sink = 0;
+
+    printf("%-12s %11s  %11s  %7s\n", "op", "int board", "bitboard", "speedup");
+
+    t0 = get_time_seconds();
+    for (long i = 0; i < iters; i++) {
+        cells.y = i & 7;
+        sink += cell_check_fall(&cells);
+    }
+    t_old = get_time_seconds() - t0;
+    t0 = get_time_seconds();
+    for (long i = 0; i < iters; i++) {
+        state.active_piece.y = i & 7;
+        sink += tetris_check_fall_10x20(&state);
+    }
+    t_new = get_time_seconds() - t0;
+    print_bench("check_fall", t_old, t_new, iters);
+
+    t0 = get_time_seconds();
+    for (long i = 0; i < iters; i++) cell_try_move(&cells, (i & 4) ? 1 : -1);
+    t_old = get_time_seconds() - t0;
+    t0 = get_time_seconds();
+    for (long i = 0; i < iters; i++) tetris_try_move_10x20(&state, (i & 4) ? 1 : -1);
+    t_new = get_time_seconds() - t0;
+    sink += cells.x + state.active_piece.x;
+    print_bench("try_move", t_old, t_new, iters);
+
+    // Rotate a T in open space, four turns bring it back
+    state.active_piece = (ActivePiece){2, 0, 3, 1};
+    cell_set_piece(&cells, PIECE_SHAPE(&state.active_piece));
+    cells.x = 3;
+    cells.y = 1;
+
+    t0 = get_time_seconds();
+    for (long i = 0; i < iters; i++) cell_rotate(&cells);
+    t_old = get_time_seconds() - t0;
+    t0 = get_time_seconds();
+    for (long i = 0; i < iters; i++) tetris_rotate_shape_10x20(&state, 1);
+    t_new = get_time_seconds() - t0;
+    sink += cells.piece.width + state.active_piece.rot;
+    print_bench("rotate", t_old, t_new, iters);
+
+    // Lock a vertical I into the well and clear, from a fresh board each time
+    state.active_piece = (ActivePiece){4, 1, 4, 0};
+    cell_set_piece(&cells, PIECE_SHAPE(&state.active_piece));
+
+    t0 = get_time_seconds();
+    for (long i = 0; i < iters; i++) {
+        memcpy(cells.cells, cells_template.cells, sizeof(cells.cells));
+        cells.x = 4;
+        cells.y = BOARD_HEIGHT - 4;
+        cell_lock(&cells);
+        sink += cell_clear(&cells);
+    }
+    t_old = get_time_seconds() - t0;
+    t0 = get_time_seconds();
+    for (long i = 0; i < iters; i++) {
+        memcpy(state.board, state_template.board, sizeof(state.board));
+        state.active_piece.x = 4;
+        state.active_piece.y = BOARD_HEIGHT - 4;
+        tetris_update_state_10x20(&state);
+        uint64_t full = tetris_find_full_rows_10x20(&state);
+        tetris_collapse_rows_10x20(&state, full);
+        sink += __builtin_popcountll(full);
+    }
+    t_new = get_time_seconds() - t0;
+    print_bench("lock+clear", t_old, t_new, iters);
+
+    printf("(%ld iterations, checksum %ld)\n", iters, sink);
+    return 0;
+}
+
+
+// Board size for the games and the bot, --size WxH
+int board_width = BOARD_WIDTH, board_height = BOARD_HEIGHT;
+int force_generic = 0; // run the generic kernel even where a specialized one exists
+
+// Turn, shift and maybe hold at random, then drop
+void play_random_piece(GameState *state, uint64_t *rng) {
+    for (int r = tetris_next_random(rng) % 4; r > 0; r--) {
+        tetris_command(state, tetris_next_random(rng) % 2 ? CMD_ROTATE_CW : CMD_ROTATE_CCW);
+    }
+    Command dir = tetris_next_random(rng) % 2 ? CMD_RIGHT : CMD_LEFT;
+    for (int m = tetris_next_random(rng) % 6; m > 0; m--) tetris_command(state, dir);
+    if (tetris_next_random(rng) % 8 == 0) tetris_command(state, CMD_HOLD);
+    tetris_command(state, CMD_HARD_DROP);
+}
+
+// Random player: a few turns and shifts, sometimes a hold, then a hard drop.
+// Returns the number of pieces locked before the game ended.
+long play_game(GameState *state, uint64_t seed) {
+    uint64_t rng = tetris_seed_random(seed ^ 0x5eed);
+    long pieces = 0;
+    EventQueue events;
+    tetris_init_game_sized(state, seed, board_width, board_height);
+    tetris_set_events(state, &events);
+    if (force_generic) state->kernel = KERNEL_GENERIC;
+    while (!state->game_over) {
+        play_random_piece(state, &rng);
+
+        Event event;
+        while (tetris_poll_event(state, &event)) {
+            if (event.type == EVENT_LOCK) pieces++;
+        }
+    }
+    return pieces;
+}
+
+typedef struct {
+    uint64_t seed;
+    long games;
+    long pieces;
+} Worker;
+
+void *worker_main(void *arg) {
+    Worker *w = arg;
+    GameState state;
+    for (long i = 0; i < w->games; i++) {
+        w->pieces += play_game(&state, w->seed + i);
+    }
+    return NULL;
+}
+
+// Play games on n threads at once, games per thread
+void run_games(int threads, long games, uint64_t seed) {
+    Worker workers[threads];
+    pthread_t ids[threads];
+    long allocs = alloc_count;
+
+    double t0 = get_time_seconds();
+    if (threads == 1) {
+        workers[0] = (Worker){seed, games, 0};
+        worker_main(&workers[0]);
+    } else {
+        for (int i = 0; i < threads; i++) {
+            workers[i] = (Worker){seed + (uint64_t)i * games, games, 0};
+            pthread_create(&ids[i], NULL, worker_main, &workers[i]);
+        }
+        for (int i = 0; i < threads; i++) pthread_join(ids[i], NULL);
+    }
+    double elapsed = get_time_seconds() - t0;
+    allocs = alloc_count - allocs;
+
+    long pieces = 0;
+    for (int i = 0; i < threads; i++) pieces += workers[i].pieces;
+    printf("%2d thread%s %8ld games  %10.0f games/s  %12.0f pieces/s",
+           threads, threads == 1 ? " " : "s", games * threads,
+           games * threads / elapsed, pieces / elapsed);
+    if (threads == 1) printf("  %ld allocations", allocs);
+    printf("\n");
+}
+
+double kernel_pieces_per_second(long games, uint64_t seed, long *checksum) {
+    GameState state;
+    long pieces = 0;
+    double t0 = get_time_seconds();
+    for (long i = 0; i < games; i++) {
+        pieces += play_game(&state, seed + i);
+        *checksum += state.score;
+    }
+    return pieces / (get_time_seconds() - t0);
+}
+
+typedef void (*KernelOp)(GameState *state);
+
+// ns per hard drop and lock of a vertical I into a well that clears the
+// two bottom rows, restarting from the same stack every time
+double kernel_lock_ns(GameState *start, KernelOp drop, KernelOp lock, long iters, long *checksum) {
+    GameState state = *start;
+    double t0 = get_time_seconds();
+    for (long i = 0; i < iters; i++) {
+        memcpy(state.board, start->board, sizeof(state.board));
+        state.active_piece = start->active_piece;
+        drop(&state);
+        lock(&state);
+        *checksum += state.total_lines;
+    }
+    return (get_time_seconds() - t0) * 1e9 / iters;
+}
+
+// Best of a few alternating runs each, the machine's noise is bigger than
+// the difference being measured
+void run_kernel(int w, int h, long games, uint64_t seed, KernelOp drop, KernelOp lock) {
+    board_width = w;
+    board_height = h;
+    long fixed_sum = 0, generic_sum = 0;
+    double fixed = 0, generic = 0;
+    for (int round = 0; round < 3; round++) {
+        force_generic = 0;
+        double rate = kernel_pieces_per_second(games, seed, &fixed_sum);
+        if (rate > fixed) fixed = rate;
+        force_generic = 1;
+        rate = kernel_pieces_per_second(games, seed, &generic_sum);
+        if (rate > generic) generic = rate;
+    }
+    force_generic = 0;
+
+    // Stack with a one-column well, the bottom two rows one I away from full
+    GameState start;
+    tetris_init_game_sized(&start, seed, w, h);
+    for (int i = h / 2; i < h; i++) {
+        for (int j = 0; j < w; j++) {
+            if (j != w / 2 && (i >= h - 2 || (i + j) % 3 != 0)) start.board[i] |= CELL_BIT(j);
+        }
+    }
+    start.board[h / 2 - 1] = 0; // keep the well open at the top
+    start.active_piece = (ActivePiece){4, 1, w / 2 - 2, 0};
+    long fixed_lock_sum = 0, generic_lock_sum = 0;
+    double fixed_ns = 1e9, generic_ns = 1e9;
+    for (int round = 0; round < 3; round++) {
+        double ns = kernel_lock_ns(&start, drop, lock, 1000000, &fixed_lock_sum);
+        if (ns < fixed_ns) fixed_ns = ns;
+        ns = kernel_lock_ns(&start, tetris_hard_drop_generic, tetris_lock_piece_generic, 1000000, &generic_lock_sum);
+        if (ns < generic_ns) generic_ns = ns;
+    }
+
+    char name[16];
+    snprintf(name, sizeof(name), "%dx%d", w, h);
+    printf("%-7s %10.0f p/s  %10.0f p/s  %5.2fx   %7.1f ns  %7.1f ns  %5.2fx%s\n", name,
+           fixed, generic, fixed / generic, fixed_ns, generic_ns, generic_ns / fixed_ns,
+           fixed_sum == generic_sum && fixed_lock_sum == generic_lock_sum ? "" : "  MISMATCH");
+}
+
+// Single-threaded games/s of every specialized board size, and the cost of
+// a drop, lock and clear, against the same work on the generic kernel
+void run_kernels(long games, uint64_t seed) {
+    printf("%-7s %14s  %14s  %6s   %10s  %10s  %6s\n", "board", "specialized", "generic", "games",
+           "lock+clear", "generic", "ops");
+#define KERNEL_ROW(w, h) run_kernel(w, h, games, seed, tetris_hard_drop_##w##x##h, tetris_lock_piece_##w##x##h);
+    BOARD_KERNELS(KERNEL_ROW)
+#undef KERNEL_ROW
+}
+
+// Snapshot save and restore against copying the whole GameState, on a game
+// some pieces in. A game restored into a state that was playing another
+// size has to play on exactly like the original.
+void run_snapshot(int w, int h, long iters, uint64_t seed) {
+    GameState state, other;
+    uint64_t rng = tetris_seed_random(seed);
+    tetris_init_game_sized(&state, seed, w, h);
+    tetris_init_game_sized(&other, seed, w, h);
+    state.animate_clears = 1; // so a snapshot can land mid-clear too
+    for (int i = 0; i < 40 && !state.game_over; i++) {
+        play_random_piece(&state, &rng);
+        for (int t = tetris_next_random(&rng) % 40; t > 0; t--) tetris_command(&state, CMD_TICK);
+    }
+
+    SnapshotRing ring;
+    snapshot_ring_init(&ring, 64);
+    static GameState copies[8];
+    long sink = 0;
+
+    double t0 = get_time_seconds();
+    for (long i = 0; i < iters; i++) {
+        state.gravity_frames = i & 15;
+        sink += snapshot_push(&ring, &state)->gravity_frames;
+    }
+    double save = get_time_seconds() - t0;
+
+    t0 = get_time_seconds();
+    for (long i = 0; i < iters; i++) {
+        snapshot_restore(&other, &ring.slots[i % ring.count]);
+        sink += other.gravity_frames;
+    }
+    double restore = get_time_seconds() - t0;
+
+    t0 = get_time_seconds();
+    for (long i = 0; i < iters; i++) {
+        state.gravity_frames = i & 15;
+        copies[i & 7] = state;
+        sink += copies[(i + 1) & 7].gravity_frames;
+    }
+    double copy = get_time_seconds() - t0;
+
+    // Play both on from the same point, the restored one from another size
+    GameSnapshot snap;
+    snapshot_save(&state, &snap);
+    tetris_init_game_sized(&other, seed + 1, w == 16 ? 10 : 16, h);
+    snapshot_restore(&other, &snap);
+    uint64_t rng_a = rng, rng_b = rng;
+    for (int i = 0; i < 200; i++) {
+        play_random_piece(&state, &rng_a);
+        play_random_piece(&other, &rng_b);
+        tetris_command(&state, CMD_TICK);
+        tetris_command(&other, CMD_TICK);
+    }
+    int same = replay_checksum(&state) == replay_checksum(&other) && state.score == other.score &&
+               state.total_lines == other.total_lines && state.game_over == other.game_over;
+
+    char name[16];
+    snprintf(name, sizeof(name), "%dx%d", w, h);
+    printf("%-7s %8.2f ns  %8.2f ns  %8.2f ns  %12.0f snapshots/s  (checksum %ld)%s\n", name,
+           save * 1e9 / iters, restore * 1e9 / iters, copy * 1e9 / iters, iters / save, sink,
+           same ? "" : "  MISMATCH");
+    snapshot_ring_free(&ring);
+}
+
+void run_snapshots(long iters, uint64_t seed) {
+    printf("GameSnapshot %zu bytes, GameState %zu bytes\n", sizeof(GameSnapshot), sizeof(GameState));
+    printf("%-7s %11s  %11s  %11s\n", "board", "save", "restore", "copy state");
+#define SNAPSHOT_ROW(w, h) run_snapshot(w, h, iters, seed);
+    BOARD_KERNELS(SNAPSHOT_ROW)
+#undef SNAPSHOT_ROW
+    run_snapshot(12, 24, iters, seed);
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Let the bot play, up to max_pieces a game, and time its decisions.
+// With record set the first game is saved as a replay, a piece per frame.
+void run_bot(int threads, int depth, int beam, long games, long max_pieces, uint64_t seed,
+             const char *record) {
+    static Bot bot;
+    Replay replay = {0};
+    bot_init(&bot, threads, depth, beam, bot_default_weights);
+    double *latency = malloc(games * max_pieces * sizeof(double));
+    long samples = 0, pieces = 0, lines = 0;
+
+    double t0 = get_time_seconds();
+    for (long g = 0; g < games; g++) {
+        GameState state;
+        tetris_init_game_sized(&state, seed + g, board_width, board_height);
+        if (record && g == 0) replay_begin(&replay, &state, seed + g);
+        for (long p = 0; p < max_pieces && !state.game_over; p++) {
+            Placement move;
+            double d0 = get_time_seconds();
+            if (!bot_choose(&bot, &state, &move)) break;
+            latency[samples++] = get_time_seconds() - d0;
+
+            Command cmds[BOT_MAX_CMDS];
+            int n = bot_placement_commands(&move, cmds);
+            for (int c = 0; c < n; c++) tetris_command(&state, cmds[c]);
+            pieces++;
+            if (record && g == 0) {
+                for (int c = 0; c < n; c++) replay_record(&replay, cmds[c]);
+                replay_record(&replay, CMD_TICK);
+                tetris_command(&state, CMD_TICK);
+            }
+        }
+        if (record && g == 0) {
+            replay_finish(&replay, &state);
+            if (!replay_save(&replay, record)) fprintf(stderr, "can't write replay %s\n", record);
+        }
+        lines += state.total_lines;
+    }
+    double elapsed = get_time_seconds() - t0;
+
+    qsort(latency, samples, sizeof(double), compare_double);
+    printf("bot: %dx%d board, depth %d, beam %d, %d thread%s\n", board_width, board_height,
+           bot.depth, bot.beam, bot.threads, bot.threads == 1 ? "" : "s");
+    printf("%ld games, %ld pieces, %.1f lines/game\n", games, pieces, (double)lines / games);
+    printf("%.0f nodes/s, %.0f nodes/decision\n",
+           bot.nodes_searched / elapsed, (double)bot.nodes_searched / samples);
+    printf("decision latency: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           latency[samples / 2] * 1e3, latency[samples * 99 / 100] * 1e3, latency[samples - 1] * 1e3);
+    free(latency);
+    replay_free(&replay);
+    bot_free(&bot);
+}
+
+// Re-simulate a recorded game repeat times, check it still ends the same way
+int run_replay(const char *path, long repeat) {
+    Replay replay = {0};
+    if (!replay_load(&replay, path)) {
+        fprintf(stderr, "can't read replay %s\n", path);
+        return 1;
+    }
+    GameState state;
+    int ok = 1;
+    long allocs = alloc_count;
+    double t0 = get_time_seconds();
+    for (long i = 0; i < repeat && ok; i++) {
+        ok = replay_play(&replay, &state) && replay_verify(&replay, &state);
+    }
+    double elapsed = get_time_seconds() - t0;
+    allocs = alloc_count - allocs;
+
+    printf("replay: seed %llu, %llu frames, %llu inputs in %zu bytes (%.2f bytes/input)\n",
+           (unsigned long long)replay.seed, (unsigned long long)replay.frames,
+           (unsigned long long)replay.inputs, replay.len,
+           replay.inputs ? (double)replay.len / replay.inputs : 0.0);
+    if (ok) {
+        printf("%ld replays  %10.0f replays/s  %12.0f frames/s  %12.0f inputs/s  %ld allocations\n",
+               repeat, repeat / elapsed, replay.frames * repeat / elapsed,
+               replay.inputs * repeat / elapsed, allocs);
+        printf("verified: %llu lines, score %llu, checksum %08x\n",
+               (unsigned long long)replay.lines, (unsigned long long)replay.score, replay.checksum);
+    } else {
+        printf("MISMATCH: recorded %llu lines, score %llu, checksum %08x;"
+               " replayed %d lines, score %d, checksum %08x\n",
+               (unsigned long long)replay.lines, (unsigned long long)replay.score, replay.checksum,
+               state.total_lines, state.score, replay_checksum(&state));
+    }
+    replay_free(&replay);
+    return !ok;
+}
+
+int main(int argc, char **argv) {
+    long games = 0;
+    int bot = 0, depth = 2, beam = 8;
+    long max_pieces = 1000;
+    const char *record = NULL, *replay = NULL;
+    int kernels = 0, snapshots = 0, ops = 0;
+    long iters = 0;
+    long repeat = 1000;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t seed = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--snapshots") == 0) {
+            snapshots = 1;
+            if (i + 1 < argc && argv[i + 1][0] != '-') iters = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--ops") == 0) {
+            ops = 1;
+            if (i + 1 < argc && argv[i + 1][0] != '-') iters = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--games") == 0 && i + 1 < argc) {
+            games = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--bot") == 0) {
+            bot = 1;
+        } else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+            depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--beam") == 0 && i + 1 < argc) {
+            beam = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pieces") == 0 && i + 1 < argc) {
+            max_pieces = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            sscanf(argv[++i], "%dx%d", &board_width, &board_height);
+        } else if (strcmp(argv[i], "--kernels") == 0) {
+            kernels = 1;
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay = argv[++i];
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = atol(argv[++i]);
+        }
+    }
+    if (games < 1) games = bot ? 4 : 20000;
+    if (threads < 1) threads = 1;
+    if (iters < 1) iters = 10000000;
+
+    tetris_init_tables();
+    if (ops) return run_ops(iters);
+    if (snapshots) {
+        run_snapshots(iters, seed);
+        return 0;
+    }
+    if (replay) return run_replay(replay, repeat > 0 ? repeat : 1);
+    if (kernels) {
+        run_kernels(games, seed);
+        return 0;
+    }
+    if (bot) {
+        if (max_pieces < 1) max_pieces = 1;
+        run_bot(threads, depth, beam, games, max_pieces, seed, record);
+        return 0;
+    }
+    run_games(1, games, seed);
+    if (threads > 1) run_games(threads, games, seed);
+    return 0;
+}
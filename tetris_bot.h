@@ -0,0 +1,395 @@
+// Placement-search bot for tetris_engine.h.
+//
+// For the piece in play, and the held (or next) piece when hold is allowed,
+// every final placement reachable by turning at the spawn point, shifting
+// sideways and hard dropping is tried on a copy of the game, through the
+// same tetris_command() calls the real game uses, so whatever the bot picks
+// is legal as played. Boards are scored with a weighted sum of aggregate
+// height, holes, bumpiness and lines cleared. A beam search keeps the best
+// `beam` boards after each piece and goes `depth` pieces deep.
+//
+// Only the current and next pieces are known to a player, so depth is
+// capped at 2, and deeper plies don't hold into an unseen piece. A first
+// ply that holds into an empty slot has already played the next piece, so
+// the second ply can only bring the held one back.
+//
+// The expansions of one ply go out as a batch of tasks to a small pool of
+// threads. Each worker starts on its own slice of the batch and steals
+// from the others' slices once it runs dry.
+#ifndef TETRIS_BOT_H
+#define TETRIS_BOT_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tetris_engine.h"
+
+#define BOT_MAX_DEPTH 2
+#define BOT_MAX_BEAM 64
+#define BOT_MAX_THREADS 64
+#define BOT_MAX_CMDS 16
+// Hold or not, times four rotations
+#define BOT_TASKS_PER_NODE 8
+// Shifts tried per task: the spawn column plus up to the board width either way
+#define BOT_MAX_SHIFTS (2 * BOARD_MAX_WIDTH + 1)
+
+typedef struct {
+    double height;    // sum of column heights
+    double holes;     // empty cells with a block somewhere above
+    double bumpiness; // sum of height steps between neighbouring columns
+    double lines;     // lines cleared on the way
+} BotWeights;
+
+// Well-known hand-tuned weights for this feature set
+static const BotWeights bot_default_weights = {-0.510066, -0.35663, -0.184483, 0.760666};
+
+// How to get a piece from spawn to its final spot
+typedef struct {
+    int hold;  // start with a hold
+    int turns; // 0..3 clockwise quarter turns, 3 is played as one ccw
+    int shift; // columns moved, negative is left
+} Placement;
+
+typedef struct {
+    double score;
+    int parent;         // beam node this was expanded from
+    Placement move;
+    Placement root;     // first-ply move this line of play started with
+    uint64_t hash;      // of the resulting board, to drop duplicates
+} BotResult;
+
+typedef struct {
+    int parent;
+    int hold, turns;
+} BotTask;
+
+// A worker's share of the batch, cache line apart so stealing doesn't bounce
+typedef struct {
+    _Alignas(64) atomic_int next;
+    int end;
+} TaskRange;
+
+typedef struct {
+    BotWeights weights;
+    int depth, beam;
+    int threads; // including the caller
+
+    // Beam, double buffered between plies
+    GameState beam_nodes[2][BOT_MAX_BEAM];
+    Placement beam_roots[2][BOT_MAX_BEAM];
+    BotResult ranked[BOT_MAX_BEAM * BOT_TASKS_PER_NODE * BOT_MAX_SHIFTS];
+
+    // Current batch
+    const GameState *nodes; // beam being expanded
+    const Placement *roots;
+    int ply;
+    int root_lines;
+    int root_hold_empty; // nothing held when the search started
+    BotTask tasks[BOT_MAX_BEAM * BOT_TASKS_PER_NODE];
+    BotResult results[BOT_MAX_BEAM * BOT_TASKS_PER_NODE][BOT_MAX_SHIFTS];
+    int result_count[BOT_MAX_BEAM * BOT_TASKS_PER_NODE];
+    int task_count;
+    TaskRange ranges[BOT_MAX_THREADS];
+    atomic_long nodes_searched;
+
+    // Worker threads park between batches
+    pthread_t ids[BOT_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    int generation;
+    int busy;
+    int quit;
+
+    // Stats
+    long decisions;
+    double decide_seconds, decide_max;
+} Bot;
+
+static inline double bot_time_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Commands that play a placement, returns how many
+static inline int bot_placement_commands(const Placement *p, Command *cmds) {
+    int n = 0;
+    if (p->hold) cmds[n++] = CMD_HOLD;
+    if (p->turns == 3) {
+        cmds[n++] = CMD_ROTATE_CCW;
+    } else {
+        for (int i = 0; i < p->turns; i++) cmds[n++] = CMD_ROTATE_CW;
+    }
+    for (int i = 0; i < abs(p->shift); i++) cmds[n++] = p->shift < 0 ? CMD_LEFT : CMD_RIGHT;
+    cmds[n++] = CMD_HARD_DROP;
+    return n;
+}
+
+// Board features in one pass from the top, `seen` has a bit for every
+// column that already had a block above the current row. Always inlined,
+// so each kernel size below gets a copy with constant bounds.
+static inline __attribute__((always_inline)) double
+bot_evaluate_rows(const GameState *state, const BotWeights *w, int lines, int width, int height) {
+    int heights[BOARD_MAX_WIDTH] = {0};
+    int holes = 0;
+    uint32_t seen = 0;
+    for (int i = 0; i < height; i++) {
+        uint32_t cells = state->board[i];
+        uint32_t fresh = cells & ~seen;
+        while (fresh) {
+            int bit = __builtin_ctz(fresh);
+            heights[bit] = height - i;
+            fresh &= fresh - 1;
+        }
+        holes += __builtin_popcount(seen & ~cells);
+        seen |= cells;
+    }
+
+    int aggregate = 0, bumpiness = 0;
+    for (int x = 0; x < width; x++) {
+        aggregate += heights[x];
+        if (x > 0) bumpiness += abs(heights[x] - heights[x - 1]);
+    }
+    return w->height * aggregate + w->holes * holes + w->bumpiness * bumpiness + w->lines * lines;
+}
+
+static inline double bot_evaluate_board(const GameState *state, const BotWeights *w, int lines) {
+    switch (state->kernel) {
+#define KERNEL_CASE(wd, ht) case KERNEL_##wd##x##ht: return bot_evaluate_rows(state, w, lines, wd, ht);
+        BOARD_KERNELS(KERNEL_CASE)
+#undef KERNEL_CASE
+    }
+    return bot_evaluate_rows(state, w, lines, state->width, state->height);
+}
+
+static inline uint64_t bot_board_hash(const GameState *state) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ (uint64_t)(state->hold_id + 1);
+    for (int i = 0; i < state->height; i++) h = (h ^ state->board[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+// Try every shift for one (node, hold, turns) combination
+static inline void bot_run_task(Bot *bot, int t) {
+    const BotTask *task = &bot->tasks[t];
+    const GameState *root = &bot->nodes[task->parent];
+    BotResult *out = bot->results[t];
+    int count = 0;
+    bot->result_count[t] = 0;
+    // After a first-ply hold into the empty slot the piece in play is the
+    // one after next, which nobody has seen
+    if (bot->ply > 0 && bot->root_hold_empty && bot->roots[task->parent].hold && !task->hold) return;
+
+    GameState turned = *root;
+    if (task->hold) {
+        // Past the first ply an empty hold would bring in a piece nobody has seen
+        if (turned.hold_used || (bot->ply > 0 && turned.hold_id < 0)) return;
+        tetris_command(&turned, CMD_HOLD);
+        if (turned.game_over) return;
+    }
+    // A turn that didn't happen would only repeat turns = 0
+    int rot = turned.active_piece.rot;
+    Placement p = {task->hold, task->turns, 0};
+    Command cmds[BOT_MAX_CMDS];
+    int n = bot_placement_commands(&p, cmds) - 1; // everything but the drop
+    for (int i = task->hold; i < n; i++) tetris_command(&turned, cmds[i]);
+    if (task->turns && turned.active_piece.rot == rot) return;
+
+    for (int dir = -1; dir <= 1; dir += 2) {
+        GameState moved = turned;
+        for (int shift = 0; shift <= root->width; shift++) {
+            if (shift > 0) {
+                int x = moved.active_piece.x;
+                tetris_command(&moved, dir < 0 ? CMD_LEFT : CMD_RIGHT);
+                if (moved.active_piece.x == x) break;
+            } else if (dir > 0) {
+                continue; // no shift was already tried going left
+            }
+
+            GameState dropped = moved;
+            tetris_command(&dropped, CMD_HARD_DROP);
+            BotResult *r = &out[count++];
+            r->parent = task->parent;
+            r->move = (Placement){task->hold, task->turns, dir * shift};
+            r->root = bot->ply == 0 ? r->move : bot->roots[task->parent];
+            r->hash = bot_board_hash(&dropped);
+            r->score = dropped.game_over ? -1e9
+                     : bot_evaluate_board(&dropped, &bot->weights, dropped.total_lines - bot->root_lines);
+        }
+    }
+    bot->result_count[t] = count;
+    atomic_fetch_add_explicit(&bot->nodes_searched, count, memory_order_relaxed);
+}
+
+// Drain our own slice, then steal from the others'
+static inline void bot_work(Bot *bot, int self) {
+    for (int k = 0; k < bot->threads; k++) {
+        TaskRange *range = &bot->ranges[(self + k) % bot->threads];
+        for (;;) {
+            int t = atomic_fetch_add_explicit(&range->next, 1, memory_order_relaxed);
+            if (t >= range->end) break;
+            bot_run_task(bot, t);
+        }
+    }
+}
+
+static inline void *bot_worker_main(void *arg) {
+    Bot *bot = arg;
+    pthread_mutex_lock(&bot->lock);
+    int self = bot->busy++; // workers number themselves 1..threads-1
+    int seen = bot->generation;
+    pthread_mutex_unlock(&bot->lock);
+
+    for (;;) {
+        pthread_mutex_lock(&bot->lock);
+        while (bot->generation == seen && !bot->quit) pthread_cond_wait(&bot->wake, &bot->lock);
+        if (bot->quit) {
+            pthread_mutex_unlock(&bot->lock);
+            return NULL;
+        }
+        seen = bot->generation;
+        pthread_mutex_unlock(&bot->lock);
+
+        bot_work(bot, self);
+
+        pthread_mutex_lock(&bot->lock);
+        if (--bot->busy == 0) pthread_cond_signal(&bot->done);
+        pthread_mutex_unlock(&bot->lock);
+    }
+}
+
+// Run the queued tasks on every thread, the caller works too
+static inline void bot_run_batch(Bot *bot) {
+    int per = (bot->task_count + bot->threads - 1) / bot->threads;
+    for (int i = 0; i < bot->threads; i++) {
+        int begin = i * per < bot->task_count ? i * per : bot->task_count;
+        int end = begin + per < bot->task_count ? begin + per : bot->task_count;
+        atomic_store_explicit(&bot->ranges[i].next, begin, memory_order_relaxed);
+        bot->ranges[i].end = end;
+    }
+    if (bot->threads > 1) {
+        pthread_mutex_lock(&bot->lock);
+        bot->busy = bot->threads - 1;
+        bot->generation++;
+        pthread_cond_broadcast(&bot->wake);
+        pthread_mutex_unlock(&bot->lock);
+    }
+
+    bot_work(bot, 0);
+
+    if (bot->threads > 1) {
+        pthread_mutex_lock(&bot->lock);
+        while (bot->busy > 0) pthread_cond_wait(&bot->done, &bot->lock);
+        pthread_mutex_unlock(&bot->lock);
+    }
+}
+
+static inline int bot_compare_results(const void *a, const void *b) {
+    double x = ((const BotResult *)a)->score, y = ((const BotResult *)b)->score;
+    return (x < y) - (x > y); // best first
+}
+
+static inline void bot_init(Bot *bot, int threads, int depth, int beam, BotWeights weights) {
+    memset(bot, 0, sizeof(*bot));
+    bot->weights = weights;
+    bot->depth = depth < 1 ? 1 : depth > BOT_MAX_DEPTH ? BOT_MAX_DEPTH : depth;
+    bot->beam = beam < 1 ? 1 : beam > BOT_MAX_BEAM ? BOT_MAX_BEAM : beam;
+    bot->threads = threads < 1 ? 1 : threads > BOT_MAX_THREADS ? BOT_MAX_THREADS : threads;
+    pthread_mutex_init(&bot->lock, NULL);
+    pthread_cond_init(&bot->wake, NULL);
+    pthread_cond_init(&bot->done, NULL);
+    bot->busy = 1;
+    for (int i = 1; i < bot->threads; i++) pthread_create(&bot->ids[i], NULL, bot_worker_main, bot);
+    // Wait until every worker has taken its number
+    for (;;) {
+        pthread_mutex_lock(&bot->lock);
+        int ready = bot->busy == bot->threads;
+        pthread_mutex_unlock(&bot->lock);
+        if (ready) break;
+        sched_yield();
+    }
+    bot->busy = 0;
+}
+
+static inline void bot_free(Bot *bot) {
+    pthread_mutex_lock(&bot->lock);
+    bot->quit = 1;
+    pthread_cond_broadcast(&bot->wake);
+    pthread_mutex_unlock(&bot->lock);
+    for (int i = 1; i < bot->threads; i++) pthread_join(bot->ids[i], NULL);
+    pthread_mutex_destroy(&bot->lock);
+    pthread_cond_destroy(&bot->wake);
+    pthread_cond_destroy(&bot->done);
+}
+
+// Pick a placement for the piece in play. Returns 0 if there's nothing to
+// do (game over or rows still clearing).
+static inline int bot_choose(Bot *bot, const GameState *state, Placement *choice) {
+    if (state->game_over || state->clearing) return 0;
+    double t0 = bot_time_seconds();
+
+    GameState (*beam_nodes)[BOT_MAX_BEAM] = bot->beam_nodes;
+    Placement (*beam_roots)[BOT_MAX_BEAM] = bot->beam_roots;
+    BotResult *ranked = bot->ranked;
+    int cur = 0, count = 1;
+    bot->root_lines = state->total_lines;
+    bot->root_hold_empty = state->hold_id < 0;
+    beam_nodes[0][0] = *state;
+    beam_nodes[0][0].animate_clears = 0;
+    beam_nodes[0][0].events = NULL; // the copies' events aren't the game's
+    *choice = (Placement){0, 0, 0};
+
+    for (int ply = 0; ply < bot->depth && count > 0; ply++) {
+        bot->nodes = beam_nodes[cur];
+        bot->roots = beam_roots[cur];
+        bot->ply = ply;
+        bot->task_count = 0;
+        for (int i = 0; i < count; i++) {
+            for (int h = 0; h < 2; h++) {
+                for (int turns = 0; turns < 4; turns++) {
+                    bot->tasks[bot->task_count++] = (BotTask){i, h, turns};
+                }
+            }
+        }
+        bot_run_batch(bot);
+
+        int ranked_count = 0;
+        for (int t = 0; t < bot->task_count; t++) {
+            memcpy(&ranked[ranked_count], bot->results[t], bot->result_count[t] * sizeof(BotResult));
+            ranked_count += bot->result_count[t];
+        }
+        if (ranked_count == 0) break;
+        qsort(ranked, ranked_count, sizeof(BotResult), bot_compare_results);
+        *choice = ranked[0].root;
+        if (ply + 1 == bot->depth) break;
+
+        // Replay the best distinct boards to get the next ply's beam
+        int next = 0;
+        for (int i = 0; i < ranked_count && next < bot->beam; i++) {
+            int dup = 0;
+            for (int j = 0; j < next && !dup; j++) dup = ranked[j].hash == ranked[i].hash;
+            if (dup || ranked[i].score <= -1e9) continue;
+            ranked[next] = ranked[i];
+
+            GameState *node = &beam_nodes[cur ^ 1][next];
+            *node = beam_nodes[cur][ranked[i].parent];
+            Command cmds[BOT_MAX_CMDS];
+            int n = bot_placement_commands(&ranked[i].move, cmds);
+            for (int c = 0; c < n; c++) tetris_command(node, cmds[c]);
+            beam_roots[cur ^ 1][next] = ranked[i].root;
+            next++;
+        }
+        cur ^= 1;
+        count = next;
+    }
+
+    double elapsed = bot_time_seconds() - t0;
+    bot->decisions++;
+    bot->decide_seconds += elapsed;
+    if (elapsed > bot->decide_max) bot->decide_max = elapsed;
+    return 1;
+}
+
+#endif
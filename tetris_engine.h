@@ -0,0 +1,513 @@
+// Headless tetris engine: bitboard, SRS rotation, line clears and scoring,
+// with no terminal, timing or global game state. Everything a game needs
+// lives in its GameState, so any number of games can run side by side, one
+// per thread or thousands in one. The piece and kick tables are shared and
+// read-only once tetris_init_tables() has run.
+//
+// Clients drive a game with tetris_command() (one of the CMD_* moves, or
+// CMD_TICK once per 60 Hz frame for gravity and the clear animation) and
+// read back what happened with tetris_poll_event(), once they've given the
+// game an EventQueue with tetris_set_events().
+//
+// Header only: the tables and functions are all static, so any number of
+// translation units can include it, and every name it defines outside the
+// types starts with tetris_ so none of them clash with the host's.
+//
+// The board size is picked per game. Sizes in BOARD_KERNELS run kernels
+// compiled for that size (tetris_kernel.h), anything else up to
+// BOARD_MAX_WIDTH x BOARD_MAX_HEIGHT runs a generic one.
+#ifndef TETRIS_ENGINE_H
+#define TETRIS_ENGINE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BOARD_WIDTH 10  // standard board, what tetris_init_game() plays on
+#define BOARD_HEIGHT 20
+#define BOARD_MIN_WIDTH 4
+#define BOARD_MIN_HEIGHT 4
+#define BOARD_MAX_WIDTH 16
+#define BOARD_MAX_HEIGHT 40
+#define NUM_SHAPES 7
+
+#define CLEAR_FLASHES 4      // row flash phases shown before a clear collapses
+#define CLEAR_FLASH_FRAMES 7 // ~120 ms per phase at 60 FPS
+
+// Bitboard: one uint16_t of cells per row, bit x = column x, which holds
+// any width up to BOARD_MAX_WIDTH with no padding. The walls and floor are
+// a bounds test, so a collision test is that plus an AND per piece row. A
+// 20-row board is 40 bytes and sits in one cache line, 40 rows take two.
+#define CELLS_ROW(w) ((uint16_t)((1u << (w)) - 1))
+#define CELL_BIT(x) ((uint16_t)(1u << (x)))
+#define MAX_SHAPE 4
+#define NUM_KICKS 5
+
+// One rotation state of a piece, built once by tetris_build_tables()
+typedef struct {
+    int width, height;        // extents
+    int spawn_dx;             // column inside the SRS box, which spawns centred
+    uint16_t rows[MAX_SHAPE]; // row masks, bit c = column c
+} Shape;
+
+// Offset to try when rotating, in board coordinates (y grows downwards)
+typedef struct {
+    int8_t dx, dy;
+} Kick;
+
+// The active piece is just a table index plus a position
+typedef struct {
+    int8_t id;  // tetris_piece_table row, 0..NUM_SHAPES-1
+    int8_t rot; // rotation state, 0..3
+    int8_t x, y;
+} ActivePiece;
+
+static Shape tetris_piece_table[NUM_SHAPES][4];
+// SRS kick tests per piece, rotation state and direction (0 cw, 1 ccw).
+// Shapes are stored trimmed to their cells, so each test already includes
+// the shift between the trimmed shapes and the SRS bounding box.
+static Kick tetris_kick_table[NUM_SHAPES][4][2][NUM_KICKS];
+
+#define PIECE_SHAPE(p) (&tetris_piece_table[(p)->id][(p)->rot])
+
+typedef enum {
+    CMD_LEFT,
+    CMD_RIGHT,
+    CMD_ROTATE_CW,
+    CMD_ROTATE_CCW,
+    CMD_SOFT_DROP,
+    CMD_HARD_DROP,
+    CMD_HOLD,
+    CMD_TICK,
+} Command;
+
+typedef enum {
+    EVENT_LOCK,      // piece, x, y, rot: where the piece settled
+    EVENT_CLEAR,     // lines, rows: rows that collapsed (bit i = row i)
+    EVENT_GAME_OVER, // piece: the piece that had no room to spawn
+} EventType;
+
+typedef struct {
+    EventType type;
+    int piece, rot, x, y;
+    int lines;
+    uint64_t rows;
+} Event;
+
+// Events not polled by the time this many more arrive are dropped, oldest first
+#define EVENT_QUEUE 8
+
+// Where a game's events go. It lives outside the GameState, which copies
+// and snapshots are made of, and a game without one drops its events.
+typedef struct {
+    Event events[EVENT_QUEUE];
+    int head, count;
+} EventQueue;
+
+// Board sizes with their own compiled kernels
+#define BOARD_KERNELS(X) X(10, 20) X(16, 20) X(10, 40)
+
+// Function name in a sized kernel copy, tetris_<name>_<w>x<h>
+#define KERNEL_SIZED(name, w, h) KERNEL_SIZED_(name, w, h)
+#define KERNEL_SIZED_(name, w, h) tetris_##name##_##w##x##h
+
+enum {
+#define KERNEL_ID(w, h) KERNEL_##w##x##h,
+    BOARD_KERNELS(KERNEL_ID)
+#undef KERNEL_ID
+    KERNEL_GENERIC,
+};
+
+// Everything the game depends on, as plain data in two cache lines, so a
+// copy of it is a complete clone. The level and gravity speed follow from
+// the lines cleared, and the rows flashing during a clear are the full
+// rows, so none of them are stored.
+typedef struct {
+    // Rows 0..height-1 of the field, top first
+    _Alignas(64) uint16_t board[BOARD_MAX_HEIGHT];
+    uint64_t rng;
+    EventQueue *events; // NULL drops events, see tetris_set_events()
+    int32_t total_lines;
+    int32_t score;
+    uint32_t pieces; // pieces that have come into play, the first included
+    uint8_t width, height;
+    uint8_t kernel;  // KERNEL_WxH for the board size, or KERNEL_GENERIC
+    int8_t hold_id;  // -1 while nothing is held
+    int8_t next_id;
+    ActivePiece active_piece;
+    uint8_t bag[NUM_SHAPES]; // 7-bag: each shape once per NUM_SHAPES pieces
+    uint8_t bag_pos;         // next bag entry, NUM_SHAPES when it's used up
+    uint8_t gravity_frames;  // frames since the last gravity step
+    uint8_t clear_frame;
+    uint8_t clearing : 1;       // full rows are flashing before they collapse
+    uint8_t hold_used : 1;
+    uint8_t game_over : 1;
+    uint8_t animate_clears : 1; // 1 to flash full rows before collapsing them
+} GameState;
+
+_Static_assert(sizeof(GameState) <= 128, "GameState should fit two cache lines");
+
+static const uint8_t tetris_shape_s[2*3] = {
+    0,1,1,
+    1,1,0
+};
+
+static const uint8_t tetris_shape_z[2*3] = {
+    1,1,0,
+    0,1,1
+};
+
+static const uint8_t tetris_shape_t[2*3] = {
+    0,1,0,
+    1,1,1
+};
+
+static const uint8_t tetris_shape_l[2*3] = {
+    0,0,1,
+    1,1,1
+};
+
+static const uint8_t tetris_shape_j[2*3] = {
+    1,0,0,
+    1,1,1
+};
+
+static const uint8_t tetris_shape_o[2*2] = {
+    1,1,
+    1,1
+};
+
+static const uint8_t tetris_shape_i[1*4] = {
+    1,1,1,1
+};
+
+// splitmix64 finaliser, spreads nearby seeds over the whole state space
+static inline uint64_t tetris_seed_random(uint64_t seed) {
+    uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return z ? z : 1; // xorshift state must not be zero
+}
+
+// xorshift64*, same sequence on every platform unlike rand()/rand_r()
+static inline uint32_t tetris_next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (uint32_t)((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static inline void tetris_push_event(GameState *state, Event event) {
+    EventQueue *queue = state->events;
+    if (!queue) return;
+    if (queue->count == EVENT_QUEUE) {
+        queue->head = (queue->head + 1) % EVENT_QUEUE;
+        queue->count--;
+    }
+    queue->events[(queue->head + queue->count) % EVENT_QUEUE] = event;
+    queue->count++;
+}
+
+// Send the game's events to queue from now on, emptied first. NULL drops
+// them, which is what a new game does until it's given one.
+static inline void tetris_set_events(GameState *state, EventQueue *queue) {
+    state->events = queue;
+    if (queue) queue->head = queue->count = 0;
+}
+
+// Take the oldest pending event, returns 0 when there are none
+static inline int tetris_poll_event(GameState *state, Event *event) {
+    EventQueue *queue = state->events;
+    if (!queue || queue->count == 0) return 0;
+    *event = queue->events[queue->head];
+    queue->head = (queue->head + 1) % EVENT_QUEUE;
+    queue->count--;
+    return 1;
+}
+
+// Spawn orientation of each piece and the SRS box it rotates in. The cells
+// sit box_row rows down from the top of the box.
+static const struct {
+    const uint8_t *cells;
+    int width, height;
+    int box, box_row;
+} tetris_base_shapes[NUM_SHAPES] = {
+    {tetris_shape_s, 3, 2, 3, 0},
+    {tetris_shape_z, 3, 2, 3, 0},
+    {tetris_shape_t, 3, 2, 3, 0},
+    {tetris_shape_o, 2, 2, 2, 0},
+    {tetris_shape_i, 4, 1, 4, 1},
+    {tetris_shape_j, 3, 2, 3, 0},
+    {tetris_shape_l, 3, 2, 3, 0},
+};
+
+// SRS kicks for the clockwise turn out of each state 0, R, 2, L, with y up
+// as in the guideline. The counter-clockwise turn into a state uses the
+// same tests negated.
+static const int8_t tetris_srs_kicks_jlstz[4][NUM_KICKS][2] = {
+    {{0, 0}, {-1, 0}, {-1,  1}, {0, -2}, {-1, -2}}, // 0 -> R
+    {{0, 0}, { 1, 0}, { 1, -1}, {0,  2}, { 1,  2}}, // R -> 2
+    {{0, 0}, { 1, 0}, { 1,  1}, {0, -2}, { 1, -2}}, // 2 -> L
+    {{0, 0}, {-1, 0}, {-1, -1}, {0,  2}, {-1,  2}}, // L -> 0
+};
+
+static const int8_t tetris_srs_kicks_i[4][NUM_KICKS][2] = {
+    {{0, 0}, {-2, 0}, { 1, 0}, {-2, -1}, { 1,  2}}, // 0 -> R
+    {{0, 0}, {-1, 0}, { 2, 0}, {-1,  2}, { 2, -1}}, // R -> 2
+    {{0, 0}, { 2, 0}, {-1, 0}, { 2,  1}, {-1, -2}}, // 2 -> L
+    {{0, 0}, { 1, 0}, {-2, 0}, { 1, -2}, {-2,  1}}, // L -> 0
+};
+
+static inline void tetris_build_tables() {
+    for (int id = 0; id < NUM_SHAPES; id++) {
+        int n = tetris_base_shapes[id].box;
+        uint8_t box[MAX_SHAPE * MAX_SHAPE] = {0};
+        for (int y = 0; y < tetris_base_shapes[id].height; y++) {
+            for (int x = 0; x < tetris_base_shapes[id].width; x++) {
+                box[(tetris_base_shapes[id].box_row + y) * n + x] =
+                    tetris_base_shapes[id].cells[y * tetris_base_shapes[id].width + x];
+            }
+        }
+
+        // Trim every rotation of the box down to its cells, remembering
+        // where the trimmed shape sits inside the box
+        int off_x[4], off_y[4];
+        for (int rot = 0; rot < 4; rot++) {
+            int min_x = n, max_x = -1, min_y = n, max_y = -1;
+            for (int y = 0; y < n; y++) {
+                for (int x = 0; x < n; x++) {
+                    if (!box[y * n + x]) continue;
+                    if (x < min_x) min_x = x;
+                    if (x > max_x) max_x = x;
+                    if (y < min_y) min_y = y;
+                    if (y > max_y) max_y = y;
+                }
+            }
+
+            Shape *shape = &tetris_piece_table[id][rot];
+            shape->width = max_x - min_x + 1;
+            shape->height = max_y - min_y + 1;
+            shape->spawn_dx = min_x;
+            for (int y = 0; y < MAX_SHAPE; y++) {
+                shape->rows[y] = 0;
+                for (int x = 0; y < shape->height && x < shape->width; x++) {
+                    if (box[(min_y + y) * n + min_x + x]) shape->rows[y] |= 1 << x;
+                }
+            }
+            off_x[rot] = min_x;
+            off_y[rot] = min_y;
+
+            // Clockwise turn inside the box: (x, y) -> (n - 1 - y, x)
+            uint8_t rotated[MAX_SHAPE * MAX_SHAPE];
+            for (int y = 0; y < n; y++) {
+                for (int x = 0; x < n; x++) {
+                    rotated[x * n + (n - 1 - y)] = box[y * n + x];
+                }
+            }
+            memcpy(box, rotated, n * n);
+        }
+
+        const int8_t (*kicks)[NUM_KICKS][2] = id == 4 ? tetris_srs_kicks_i : tetris_srs_kicks_jlstz;
+        for (int rot = 0; rot < 4; rot++) {
+            for (int dir = 0; dir < 2; dir++) {
+                int to = dir == 0 ? (rot + 1) & 3 : (rot + 3) & 3;
+                for (int k = 0; k < NUM_KICKS; k++) {
+                    // O doesn't kick, it only has the one state
+                    int kx = 0, ky = 0;
+                    if (n > 2) {
+                        kx = dir == 0 ? kicks[rot][k][0] : -kicks[to][k][0];
+                        ky = dir == 0 ? kicks[rot][k][1] : -kicks[to][k][1];
+                    }
+                    Kick *kick = &tetris_kick_table[id][rot][dir][k];
+                    kick->dx = kx + off_x[to] - off_x[rot];
+                    kick->dy = -ky + off_y[to] - off_y[rot];
+                }
+            }
+        }
+    }
+}
+
+static pthread_once_t tetris_tables_once = PTHREAD_ONCE_INIT;
+
+// Build the shared piece and kick tables, safe to call from any thread
+static inline void tetris_init_tables() {
+    pthread_once(&tetris_tables_once, tetris_build_tables);
+}
+
+// Every 10 lines is a level
+static inline int tetris_level(const GameState *state) {
+    int start_level = 0; // TEMP
+    return start_level + state->total_lines / 10;
+}
+
+// Frames per gravity step at the current level
+static inline int tetris_speed(const GameState *state) {
+    int lvl = tetris_level(state);
+
+    if (lvl <= 0) return 48; // DAS version initial speed for lvl 00
+    else if (lvl == 1) return 43;
+    else if (lvl == 2) return 38;
+    else if (lvl == 3) return 33;
+    else if (lvl == 4) return 28;
+    else if (lvl == 5) return 23;
+    else if (lvl == 6) return 18;
+    else if (lvl == 7) return 13;
+    else if (lvl == 8) return 8;
+    else if (lvl == 9) return 6;
+    else if (lvl >= 10 && lvl <= 12) return 5;
+    else if (lvl >= 13 && lvl <= 15) return 4;
+    else if (lvl >= 16 && lvl <= 18) return 3;
+    else if (lvl >= 19 && lvl <= 28) return 2;
+    else return 1;
+}
+
+// Deal shapes from a shuffled bag of all seven, so there is never a
+// drought longer than 12 pieces and the sequence only depends on the seed
+static inline int tetris_next_shape(GameState *state) {
+    if (state->bag_pos == NUM_SHAPES) {
+        for (int i = 0; i < NUM_SHAPES; i++) state->bag[i] = i;
+        for (int i = NUM_SHAPES - 1; i > 0; i--) {
+            int j = tetris_next_random(&state->rng) % (i + 1);
+            uint8_t t = state->bag[i];
+            state->bag[i] = state->bag[j];
+            state->bag[j] = t;
+        }
+        state->bag_pos = 0;
+    }
+    return state->bag[state->bag_pos++];
+}
+
+static inline int tetris_line_score(int lvl, int lines_cleared) {
+    switch (lines_cleared) {
+        case 1: return 40 * (lvl + 1);
+        case 2: return 100 * (lvl + 1);
+        case 3: return 300 * (lvl + 1);
+        case 4: return 1200 * (lvl + 1);
+        default: return 0;
+    }
+}
+
+// Score the lines at the level they were cleared on
+static inline void tetris_add_lines(GameState *state, int cleared) {
+    state->score += tetris_line_score(tetris_level(state), cleared);
+    state->total_lines += cleared;
+}
+
+// One sized copy per BOARD_KERNELS entry. A copy whose size isn't in the
+// list fails its static check, and a size in the list with no copy here
+// leaves the dispatch below calling functions that don't exist.
+#define KERNEL_WIDTH 10
+#define KERNEL_HEIGHT 20
+#include "tetris_kernel.h"
+
+#define KERNEL_WIDTH 16
+#define KERNEL_HEIGHT 20
+#include "tetris_kernel.h"
+
+#define KERNEL_WIDTH 10
+#define KERNEL_HEIGHT 40
+#include "tetris_kernel.h"
+
+#define KERNEL(name) tetris_##name##_generic
+#define KERNEL_WIDTH (state->width)
+#define KERNEL_HEIGHT (state->height)
+#include "tetris_kernel.h"
+
+// Apply one command. Moves are ignored once the game is over and while
+// cleared rows are flashing.
+static inline void tetris_command(GameState *state, Command cmd) {
+    switch (state->kernel) {
+#define KERNEL_CASE(w, h) case KERNEL_##w##x##h: tetris_command_##w##x##h(state, cmd); break;
+        BOARD_KERNELS(KERNEL_CASE)
+#undef KERNEL_CASE
+        default: tetris_command_generic(state, cmd); break;
+    }
+}
+
+// Could the active piece move down a row? Lets a move generator tell a
+// lock from a fall without playing the soft drop.
+static inline int tetris_can_fall(GameState *state) {
+    switch (state->kernel) {
+#define KERNEL_CASE(w, h) case KERNEL_##w##x##h: return tetris_check_fall_##w##x##h(state);
+        BOARD_KERNELS(KERNEL_CASE)
+#undef KERNEL_CASE
+    }
+    return tetris_check_fall_generic(state);
+}
+
+// Bring piece id in at the top as if it were next, game over if it doesn't fit
+static inline void tetris_place_piece(GameState *state, int id) {
+    switch (state->kernel) {
+#define KERNEL_CASE(w, h) case KERNEL_##w##x##h: tetris_place_piece_##w##x##h(state, id); return;
+        BOARD_KERNELS(KERNEL_CASE)
+#undef KERNEL_CASE
+    }
+    tetris_place_piece_generic(state, id);
+}
+
+// Rows flashing before they collapse (bit i = row i), 0 if none
+static inline uint64_t tetris_clearing_rows(const GameState *state) {
+    if (!state->clearing) return 0;
+    switch (state->kernel) {
+#define KERNEL_CASE(w, h) case KERNEL_##w##x##h: return tetris_find_full_rows_##w##x##h(state);
+        BOARD_KERNELS(KERNEL_CASE)
+#undef KERNEL_CASE
+    }
+    return tetris_find_full_rows_generic(state);
+}
+
+// Kernel for a board size, KERNEL_GENERIC if it has none of its own
+static inline int tetris_board_kernel(int width, int height) {
+#define KERNEL_PICK(w, h) if (width == w && height == h) return KERNEL_##w##x##h;
+    BOARD_KERNELS(KERNEL_PICK)
+#undef KERNEL_PICK
+    return KERNEL_GENERIC;
+}
+
+// Start a new game on a width x height board, clamped to what the bitboard
+// can hold. The seed decides the piece sequence.
+static inline void tetris_init_game_sized(GameState *state, uint64_t seed, int width, int height) {
+    tetris_init_tables();
+
+    width = width < BOARD_MIN_WIDTH ? BOARD_MIN_WIDTH : width > BOARD_MAX_WIDTH ? BOARD_MAX_WIDTH : width;
+    height = height < BOARD_MIN_HEIGHT ? BOARD_MIN_HEIGHT : height > BOARD_MAX_HEIGHT ? BOARD_MAX_HEIGHT : height;
+    state->width = width;
+    state->height = height;
+    state->kernel = tetris_board_kernel(width, height);
+
+    // Reset hold and active piece
+    state->hold_id = -1;
+    state->active_piece = (ActivePiece){0};
+
+    // Reset counters and flags
+    state->total_lines = 0;
+    state->score = 0;
+    state->pieces = 0;
+    state->hold_used = 0;
+    state->game_over = 0;
+    state->gravity_frames = 0;
+    state->animate_clears = 0;
+    state->clearing = 0;
+    state->clear_frame = 0;
+    state->rng = tetris_seed_random(seed);
+    state->bag_pos = NUM_SHAPES;
+    state->events = NULL;
+
+    // Clear board and spawn first piece
+    switch (state->kernel) {
+#define KERNEL_CASE(w, h) case KERNEL_##w##x##h: tetris_start_##w##x##h(state); break;
+        BOARD_KERNELS(KERNEL_CASE)
+#undef KERNEL_CASE
+        default: tetris_start_generic(state); break;
+    }
+}
+
+// Start a new game on the standard board
+static inline void tetris_init_game(GameState *state, uint64_t seed) {
+    tetris_init_game_sized(state, seed, BOARD_WIDTH, BOARD_HEIGHT);
+}
+
+#endif
@@ -0,0 +1,217 @@
+// Board kernels for tetris_engine.h: everything whose masks or loop bounds
+// depend on the board size. The engine includes this once per size in
+// BOARD_KERNELS with KERNEL_WIDTH and KERNEL_HEIGHT as constants, so each
+// copy compiles to fixed masks and fully known loops, and once more with
+// both read from the GameState for any other size. KERNEL(name) gives each
+// copy its own function names, from the size unless the includer set it.
+// No include guard on purpose.
+
+#ifndef KERNEL
+#define KERNEL(name) KERNEL_SIZED(name, KERNEL_WIDTH, KERNEL_HEIGHT)
+#define KERNEL_LISTED(w, h) || (KERNEL_WIDTH == (w) && KERNEL_HEIGHT == (h))
+_Static_assert(0 BOARD_KERNELS(KERNEL_LISTED), "sized kernel copy missing from BOARD_KERNELS");
+#undef KERNEL_LISTED
+#endif
+
+#define K_FULL CELLS_ROW(KERNEL_WIDTH)
+
+static inline void KERNEL(clear_board)(GameState *state) {
+    for (int i = 0; i < KERNEL_HEIGHT; i++) state->board[i] = 0;
+}
+
+// Would the shape overlap the walls, floor or settled blocks at (x, y)?
+// The hottest test in the engine, so it goes inline into every caller.
+static inline __attribute__((always_inline)) int
+KERNEL(collides)(const GameState *state, const Shape *shape, int x, int y) {
+    // Off the sides, above the top or through the floor counts as blocked
+    if (y < 0 || y + shape->height > KERNEL_HEIGHT || x < 0 ||
+        x + shape->width > KERNEL_WIDTH) return 1;
+    for (int r = 0; r < shape->height; r++) {
+        if (state->board[y + r] & (shape->rows[r] << x)) return 1;
+    }
+    return 0;
+}
+
+// Put piece id at the top of the board, game over if there's no room
+static inline void KERNEL(place_piece)(GameState *state, int id) {
+    ActivePiece *piece = &state->active_piece;
+    piece->id = id;
+    piece->rot = 0;
+    piece->x = (KERNEL_WIDTH - tetris_base_shapes[id].box) / 2 + PIECE_SHAPE(piece)->spawn_dx;
+    piece->y = 0;
+    if (KERNEL(collides)(state, PIECE_SHAPE(piece), piece->x, piece->y)) {
+        state->game_over = 1;
+        tetris_push_event(state, (Event){EVENT_GAME_OVER, id});
+    }
+}
+
+static inline void KERNEL(spawn_piece)(GameState *state) {
+    state->pieces++;
+    KERNEL(place_piece)(state, state->next_id);
+    state->next_id = tetris_next_shape(state);
+    state->hold_used = 0;
+}
+
+static inline int KERNEL(check_fall)(GameState *state) {
+    ActivePiece *piece = &state->active_piece;
+    return !KERNEL(collides)(state, PIECE_SHAPE(piece), piece->x, piece->y + 1);
+}
+
+static inline void KERNEL(hard_drop)(GameState *state) {
+    while (KERNEL(check_fall)(state)) {
+        state->active_piece.y++;
+    }
+}
+
+static inline void KERNEL(try_move)(GameState *state, int dir) {
+    ActivePiece *piece = &state->active_piece;
+    if (!KERNEL(collides)(state, PIECE_SHAPE(piece), piece->x + dir, piece->y)) {
+        piece->x += dir;
+    }
+}
+
+static inline void KERNEL(update_state)(GameState *state) {
+    ActivePiece *piece = &state->active_piece;
+    const Shape *shape = PIECE_SHAPE(piece);
+    for (int y = 0; y < shape->height; y++) {
+        state->board[piece->y + y] |= shape->rows[y] << piece->x;
+    }
+}
+
+// Turn the piece clockwise (dir 1) or counter-clockwise (dir -1), taking the
+// first SRS kick that fits
+static inline void KERNEL(rotate_shape)(GameState *state, int dir) {
+    ActivePiece *piece = &state->active_piece;
+    int rot = (piece->rot + dir) & 3;
+    const Shape *shape = &tetris_piece_table[piece->id][rot];
+    const Kick *kicks = tetris_kick_table[piece->id][piece->rot][dir < 0];
+    for (int k = 0; k < NUM_KICKS; k++) {
+        if (!KERNEL(collides)(state, shape, piece->x + kicks[k].dx, piece->y + kicks[k].dy)) {
+            piece->x += kicks[k].dx;
+            piece->y += kicks[k].dy;
+            piece->rot = rot;
+            return;
+        }
+    }
+}
+
+static inline void KERNEL(hold)(GameState *state) {
+    ActivePiece *piece = &state->active_piece;
+    if (state->hold_used) return;
+
+    int held = state->hold_id;
+    state->hold_id = piece->id;
+    if (held < 0) {
+        KERNEL(spawn_piece)(state);
+    } else {
+        KERNEL(place_piece)(state, held);
+    }
+    state->hold_used = 1;
+}
+
+// Bit i set = row i is full
+static inline uint64_t KERNEL(find_full_rows)(const GameState *state) {
+    uint64_t full = 0;
+    for (int i = 0; i < KERNEL_HEIGHT; i++) {
+        if (state->board[i] == K_FULL) full |= 1ull << i;
+    }
+    return full;
+}
+
+// Drop everything above each cleared row by one, top to bottom so lower
+// row indices stay valid
+static inline void KERNEL(collapse_rows)(GameState *state, uint64_t rows) {
+    for (int i = 0; i < KERNEL_HEIGHT; i++) {
+        if (!(rows & (1ull << i))) continue;
+        memmove(&state->board[1], &state->board[0], i * sizeof(state->board[0]));
+        state->board[0] = 0;
+    }
+}
+
+// Collapse the cleared rows, score them and bring in the next piece
+static inline void KERNEL(finish_clear)(GameState *state, uint64_t rows) {
+    int lines = __builtin_popcountll(rows);
+    if (rows) tetris_push_event(state, (Event){EVENT_CLEAR, .lines = lines, .rows = rows});
+    KERNEL(collapse_rows)(state, rows);
+    tetris_add_lines(state, lines);
+    state->clearing = 0;
+    state->clear_frame = 0;
+    KERNEL(spawn_piece)(state);
+}
+
+// Lock the active piece into the board. Full rows either start the flash
+// animation, with the next piece held back until step_clear() finishes it,
+// or collapse right away when animations are off.
+static inline void KERNEL(lock_piece)(GameState *state) {
+    ActivePiece *piece = &state->active_piece;
+    tetris_push_event(state, (Event){EVENT_LOCK, piece->id, piece->rot, piece->x, piece->y});
+    KERNEL(update_state)(state);
+    uint64_t full = KERNEL(find_full_rows)(state);
+    if (full && state->animate_clears) {
+        // The full rows stay on the board, and so say which rows are flashing
+        state->clearing = 1;
+        state->clear_frame = 0;
+    } else {
+        KERNEL(finish_clear)(state, full);
+    }
+}
+
+// Advance the clear animation by one frame
+static inline void KERNEL(step_clear)(GameState *state) {
+    if (!state->clearing) return;
+    if (++state->clear_frame >= CLEAR_FLASHES * CLEAR_FLASH_FRAMES) {
+        KERNEL(finish_clear)(state, KERNEL(find_full_rows)(state));
+    }
+}
+
+// Move down a row, or lock the piece if it can't
+static inline void KERNEL(soft_drop)(GameState *state) {
+    if (KERNEL(check_fall)(state)) {
+        state->active_piece.y++;
+    } else {
+        KERNEL(lock_piece)(state);
+    }
+}
+
+// One frame: advance a running clear animation, otherwise count towards the
+// next gravity step
+static inline void KERNEL(tick)(GameState *state) {
+    if (state->clearing) {
+        // Gravity waits for the animation, the new piece gets a full interval
+        KERNEL(step_clear)(state);
+        state->gravity_frames = 0;
+    } else if (++state->gravity_frames > tetris_speed(state)) {
+        state->gravity_frames = 0;
+        KERNEL(soft_drop)(state);
+    }
+}
+
+static inline void KERNEL(command)(GameState *state, Command cmd) {
+    if (state->game_over) return;
+    if (state->clearing && cmd != CMD_TICK) return;
+    switch (cmd) {
+        case CMD_LEFT: KERNEL(try_move)(state, -1); break;
+        case CMD_RIGHT: KERNEL(try_move)(state, 1); break;
+        case CMD_ROTATE_CW: KERNEL(rotate_shape)(state, 1); break;
+        case CMD_ROTATE_CCW: KERNEL(rotate_shape)(state, -1); break;
+        case CMD_SOFT_DROP: KERNEL(soft_drop)(state); break;
+        case CMD_HARD_DROP:
+            KERNEL(hard_drop)(state);
+            KERNEL(lock_piece)(state);
+            break;
+        case CMD_HOLD: KERNEL(hold)(state); break;
+        case CMD_TICK: KERNEL(tick)(state); break;
+    }
+}
+
+// Empty board and the first piece in play
+static inline void KERNEL(start)(GameState *state) {
+    KERNEL(clear_board)(state);
+    state->next_id = tetris_next_shape(state);
+    KERNEL(spawn_piece)(state);
+}
+
+#undef K_FULL
+#undef KERNEL
+#undef KERNEL_WIDTH
+#undef KERNEL_HEIGHT
@@ -0,0 +1,542 @@
+// Placement perft for tetris_engine.h: how many ways there are to place the
+// next N pieces of a fixed sequence on a given board.
+//
+// The placements of one piece are every distinct spot it can lock in,
+// found by a flood fill over (rotation, x, y) through the engine's own
+// moves: left, right, both turns with their kicks, and a row down while
+// tetris_can_fall() allows. Tucks and spins under overhangs count, and
+// rotations that cover the same cells count once. Each placement is played
+// with the engine's lock and clear, and the search carries on from the
+// board it leaves. Hold isn't used, so the pieces come strictly in order.
+//
+// Like chess perft the count is of paths, and different orders of play
+// often leave the same board. Those transpositions are looked up in a
+// fixed-size hash table keyed by a Zobrist hash of the board, the piece
+// and its rotation and position, and the depth left. The table is shared
+// by all threads without locks: each entry stores the key xor'd with the
+// count next to the count, so an entry torn by two racing writers just
+// reads back as a miss.
+//
+// The counts are a correctness check on the engine's moves, kicks and
+// clears, and the time to get them is a benchmark of its move generation.
+// --check compares the table against a plain search and the size's
+// specialized kernel against the generic one, --suite runs a fixed set of
+// positions against known counts.
+//
+//   cc -O2 tetris_perft.c -o tetris_perft -lpthread
+//   ./tetris_perft [--depth N] [--size WxH] [--seed N] [--pieces SZTOIJL...]
+//                  [--board FILE] [--threads N] [--hash MB] [--generic] [--check]
+//   ./tetris_perft --suite [--threads N] [--hash MB]
+//
+// A board file has one line per row, bottom row last, '.' for an empty cell
+// and anything else for a block.
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tetris_engine.h"
+
+#define PERFT_MAX_DEPTH 16
+// Every (rotation, x, y) a piece can be at without overlapping the walls
+#define PERFT_COLUMNS BOARD_MAX_WIDTH
+#define PERFT_ROWS (BOARD_MAX_HEIGHT + 1)
+#define PERFT_MAX_POSITIONS (4 * PERFT_ROWS * PERFT_COLUMNS)
+
+const char piece_letters[] = "SZTOIJL"; // by piece id
+
+typedef struct {
+    _Atomic uint64_t check; // key ^ count, 0 while empty
+    _Atomic uint64_t count;
+} TableEntry;
+
+// Everything a search thread writes, allocated once up front
+typedef struct {
+    GameState scratch;
+    uint32_t stamp; // marks seen[] and locked[] entries of the current flood fill
+    uint32_t seen[4][PERFT_ROWS][PERFT_COLUMNS];
+    uint32_t locked[4][PERFT_ROWS][PERFT_COLUMNS];
+    ActivePiece queue[PERFT_MAX_POSITIONS];
+    ActivePiece locks[PERFT_MAX_DEPTH][PERFT_MAX_POSITIONS];
+    long expanded; // positions the flood fills went through
+    long probes, hits;
+} Arena;
+
+// Zobrist keys
+uint64_t cell_keys[BOARD_MAX_HEIGHT][BOARD_MAX_WIDTH];
+uint64_t piece_keys[NUM_SHAPES][4];
+uint64_t x_keys[PERFT_COLUMNS];
+uint64_t y_keys[PERFT_ROWS];
+uint64_t depth_keys[PERFT_MAX_DEPTH + 1];
+
+// Rotations with the same trimmed shape lock into the same cells, so each
+// maps to the first rotation it matches
+int canonical_rot[NUM_SHAPES][4];
+
+TableEntry *table;
+uint64_t table_mask;
+
+// Search being run: one job per placement of the first piece
+int sequence[PERFT_MAX_DEPTH];
+GameState root;
+uint64_t root_key;
+int root_depth;
+ActivePiece root_locks[PERFT_MAX_POSITIONS];
+int root_lock_count;
+atomic_int next_job;
+atomic_ullong total;
+
+double get_time_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t random_key(uint64_t *rng) {
+    uint64_t hi = tetris_next_random(rng);
+    return hi << 32 | tetris_next_random(rng);
+}
+
+void init_keys() {
+    uint64_t rng = tetris_seed_random(0x7e7715);
+    for (int y = 0; y < BOARD_MAX_HEIGHT; y++) {
+        for (int x = 0; x < BOARD_MAX_WIDTH; x++) cell_keys[y][x] = random_key(&rng);
+    }
+    for (int id = 0; id < NUM_SHAPES; id++) {
+        for (int rot = 0; rot < 4; rot++) piece_keys[id][rot] = random_key(&rng);
+    }
+    for (int x = 0; x < PERFT_COLUMNS; x++) x_keys[x] = random_key(&rng);
+    for (int y = 0; y < PERFT_ROWS; y++) y_keys[y] = random_key(&rng);
+    for (int d = 0; d <= PERFT_MAX_DEPTH; d++) depth_keys[d] = random_key(&rng);
+
+    for (int id = 0; id < NUM_SHAPES; id++) {
+        for (int rot = 0; rot < 4; rot++) {
+            canonical_rot[id][rot] = rot;
+            for (int r = 0; r < rot; r++) {
+                const Shape *a = &tetris_piece_table[id][r], *b = &tetris_piece_table[id][rot];
+                if (a->width == b->width && a->height == b->height &&
+                    memcmp(a->rows, b->rows, sizeof(a->rows)) == 0) {
+                    canonical_rot[id][rot] = canonical_rot[id][r];
+                    break;
+                }
+            }
+        }
+    }
+}
+
+uint64_t board_key(const GameState *state) {
+    uint64_t key = 0;
+    for (int y = 0; y < state->height; y++) {
+        uint32_t cells = state->board[y];
+        while (cells) {
+            key ^= cell_keys[y][__builtin_ctz(cells)];
+            cells &= cells - 1;
+        }
+    }
+    return key;
+}
+
+// The cells a piece covers, xor'd into a board key
+uint64_t piece_cells_key(const ActivePiece *piece) {
+    const Shape *shape = PIECE_SHAPE(piece);
+    uint64_t key = 0;
+    for (int r = 0; r < shape->height; r++) {
+        for (uint32_t bits = shape->rows[r]; bits; bits &= bits - 1) {
+            key ^= cell_keys[piece->y + r][piece->x + __builtin_ctz(bits)];
+        }
+    }
+    return key;
+}
+
+uint64_t position_key(const ActivePiece *piece) {
+    return piece_keys[piece->id][piece->rot] ^ x_keys[piece->x] ^ y_keys[piece->y];
+}
+
+int table_probe(Arena *arena, uint64_t key, uint64_t *count) {
+    TableEntry *e = &table[key & table_mask];
+    uint64_t c = atomic_load_explicit(&e->count, memory_order_relaxed);
+    uint64_t check = atomic_load_explicit(&e->check, memory_order_relaxed);
+    arena->probes++;
+    if ((check ^ c) != key) return 0;
+    arena->hits++;
+    *count = c;
+    return 1;
+}
+
+// Always replace, the deeper entries are rarer but so are their repeats
+void table_store(uint64_t key, uint64_t count) {
+    TableEntry *e = &table[key & table_mask];
+    atomic_store_explicit(&e->count, count, memory_order_relaxed);
+    atomic_store_explicit(&e->check, key ^ count, memory_order_relaxed);
+}
+
+void table_clear() {
+    if (table) memset(table, 0, (table_mask + 1) * sizeof(TableEntry));
+}
+
+// Flood fill from the active piece, writes each distinct lock position to
+// out and returns how many there are
+int generate_locks(Arena *arena, const GameState *node, ActivePiece *out) {
+    static const Command moves[] = {CMD_LEFT, CMD_RIGHT, CMD_ROTATE_CW, CMD_ROTATE_CCW};
+    GameState *s = &arena->scratch;
+    *s = *node;
+    if (++arena->stamp == 0) {
+        memset(arena->seen, 0, sizeof(arena->seen));
+        memset(arena->locked, 0, sizeof(arena->locked));
+        arena->stamp = 1;
+    }
+    uint32_t stamp = arena->stamp;
+
+    ActivePiece *queue = arena->queue;
+    int head = 0, tail = 0, count = 0;
+    queue[tail++] = node->active_piece;
+    arena->seen[node->active_piece.rot][node->active_piece.y][node->active_piece.x] = stamp;
+    while (head < tail) {
+        ActivePiece p = queue[head++];
+        for (int m = 0; m < 5; m++) {
+            s->active_piece = p;
+            if (m < 4) {
+                tetris_command(s, moves[m]);
+            } else if (tetris_can_fall(s)) {
+                s->active_piece.y++;
+            } else {
+                // Can't go down, so it locks here
+                uint32_t *lock = &arena->locked[canonical_rot[p.id][p.rot]][p.y][p.x];
+                if (*lock != stamp) {
+                    *lock = stamp;
+                    out[count++] = p;
+                }
+                continue;
+            }
+            const ActivePiece *q = &s->active_piece;
+            uint32_t *seen = &arena->seen[q->rot][q->y][q->x];
+            if (*seen != stamp) {
+                *seen = stamp;
+                queue[tail++] = *q;
+            }
+        }
+    }
+    arena->expanded += tail;
+    return count;
+}
+
+// Placement sequences of `depth` pieces from node, whose board hashes to key
+uint64_t perft(Arena *arena, const GameState *node, uint64_t key, int depth) {
+    uint64_t entry = (key ^ position_key(&node->active_piece) ^ depth_keys[depth]) | 1;
+    uint64_t count = 0;
+    if (table && table_probe(arena, entry, &count)) return count;
+
+    ActivePiece *locks = arena->locks[depth - 1];
+    int n = generate_locks(arena, node, locks);
+    if (depth == 1) {
+        count = n; // leaves aren't played out
+    } else {
+        int ply = root_depth - depth;
+        for (int i = 0; i < n; i++) {
+            GameState child = *node;
+            child.active_piece = locks[i];
+            child.next_id = sequence[ply + 1];
+            tetris_command(&child, CMD_HARD_DROP);
+            if (child.game_over) continue; // the next piece had nowhere to go
+            uint64_t child_key = child.total_lines == node->total_lines
+                               ? key ^ piece_cells_key(&locks[i])
+                               : board_key(&child);
+            count += perft(arena, &child, child_key, depth - 1);
+        }
+    }
+    if (table) table_store(entry, count);
+    return count;
+}
+
+void *perft_main(void *arg) {
+    Arena *arena = arg;
+    for (;;) {
+        int job = atomic_fetch_add_explicit(&next_job, 1, memory_order_relaxed);
+        if (job >= root_lock_count) break;
+        GameState child = root;
+        child.active_piece = root_locks[job];
+        child.next_id = sequence[1];
+        tetris_command(&child, CMD_HARD_DROP);
+        if (child.game_over) continue;
+        uint64_t key = child.total_lines == root.total_lines
+                     ? root_key ^ piece_cells_key(&root_locks[job])
+                     : board_key(&child);
+        atomic_fetch_add_explicit(&total, perft(arena, &child, key, root_depth - 1), memory_order_relaxed);
+    }
+    return NULL;
+}
+
+typedef struct {
+    uint64_t count;
+    double seconds;
+    long expanded, probes, hits;
+} PerftResult;
+
+// perft(depth) of the root position on `threads` threads, starting from an
+// empty table. The first piece's placements are shared out between them.
+PerftResult run_perft(Arena **arenas, int threads, int depth) {
+    PerftResult result = {0};
+    for (int t = 0; t < threads; t++) arenas[t]->expanded = arenas[t]->probes = arenas[t]->hits = 0;
+    table_clear();
+
+    double t0 = get_time_seconds();
+    root_depth = depth;
+    root_key = board_key(&root);
+    if (root.game_over) {
+        result.count = 0;
+    } else if (depth == 1) {
+        result.count = generate_locks(arenas[0], &root, root_locks);
+    } else {
+        root_lock_count = generate_locks(arenas[0], &root, root_locks);
+        atomic_store(&next_job, 0);
+        atomic_store(&total, 0);
+        pthread_t ids[threads];
+        for (int t = 1; t < threads; t++) pthread_create(&ids[t], NULL, perft_main, arenas[t]);
+        perft_main(arenas[0]);
+        for (int t = 1; t < threads; t++) pthread_join(ids[t], NULL);
+        result.count = atomic_load(&total);
+    }
+    result.seconds = get_time_seconds() - t0;
+
+    for (int t = 0; t < threads; t++) {
+        result.expanded += arenas[t]->expanded;
+        result.probes += arenas[t]->probes;
+        result.hits += arenas[t]->hits;
+    }
+    return result;
+}
+
+void print_result(const char *label, int depth, PerftResult r) {
+    printf("%-10s depth %2d %15llu  %8.3f s  %12.0f placements/s  %11.0f positions/s",
+           label, depth, (unsigned long long)r.count, r.seconds,
+           r.count / (r.seconds + 1e-9), r.expanded / (r.seconds + 1e-9));
+    if (r.probes) printf("  %4.1f%% table hits", 100.0 * r.hits / r.probes);
+    printf("\n");
+}
+
+// Fill rows from the bottom with board lines ('.' empty), NULL-terminated
+void set_board(GameState *state, const char **lines) {
+    int n = 0;
+    while (lines[n]) n++;
+    for (int i = 0; i < n && i < state->height; i++) {
+        const char *line = lines[n - 1 - i];
+        int y = state->height - 1 - i;
+        for (int x = 0; x < state->width && line[x] && line[x] != '\n'; x++) {
+            if (line[x] != '.') state->board[y] |= CELL_BIT(x);
+        }
+    }
+}
+
+int load_board(GameState *state, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    static char rows[BOARD_MAX_HEIGHT + 1][256];
+    const char *lines[BOARD_MAX_HEIGHT + 1];
+    int n = 0;
+    char buf[256];
+    while (fgets(buf, sizeof(buf), f)) {
+        // Keep the bottom rows if the file has more than the board
+        if (n == BOARD_MAX_HEIGHT) {
+            memmove(rows[0], rows[1], sizeof(rows[0]) * (BOARD_MAX_HEIGHT - 1));
+            n--;
+        }
+        memcpy(rows[n++], buf, sizeof(buf));
+    }
+    fclose(f);
+    for (int i = 0; i < n; i++) lines[i] = rows[i];
+    lines[n] = NULL;
+    set_board(state, lines);
+    return 1;
+}
+
+// Set up the root: the board, the piece sequence (the seed's 7-bag unless
+// pieces names one) and the first piece at the spawn point
+int setup_root(int width, int height, uint64_t seed, const char *pieces, const char **board, int depth) {
+    tetris_init_game_sized(&root, seed, width, height);
+    // The game's own deal: the piece in play, the next one, then the bag
+    sequence[0] = root.active_piece.id;
+    sequence[1] = root.next_id;
+    for (int i = 2; i < PERFT_MAX_DEPTH; i++) sequence[i] = tetris_next_shape(&root);
+    if (pieces) {
+        int n = strlen(pieces);
+        if (n < depth) {
+            fprintf(stderr, "--pieces needs at least %d pieces for depth %d\n", depth, depth);
+            return 0;
+        }
+        for (int i = 0; i < n && i < PERFT_MAX_DEPTH; i++) {
+            const char *letter = strchr(piece_letters, pieces[i]);
+            if (!letter || !*letter) {
+                fprintf(stderr, "unknown piece '%c', pieces are %s\n", pieces[i], piece_letters);
+                return 0;
+            }
+            sequence[i] = letter - piece_letters;
+        }
+    }
+    if (board) set_board(&root, board);
+    tetris_place_piece(&root, sequence[0]);
+    root.next_id = sequence[1];
+    return 1;
+}
+
+void print_root(int depth) {
+    printf("%dx%d board, %s kernel, pieces ", root.width, root.height,
+           root.kernel == KERNEL_GENERIC ? "generic" : "specialized");
+    for (int i = 0; i < depth; i++) putchar(piece_letters[sequence[i]]);
+    printf("%s\n", root.game_over ? ", no room for the first piece" : "");
+}
+
+// Positions with known counts, from the table-less search. A change to any
+// of these means the engine's moves, kicks or clears changed.
+const char *stack_board[] = {
+    "..........",
+    "...#......",
+    "...#...##.",
+    "#..##..##.",
+    "##.###.###",
+    "###.######",
+    "####.#####",
+    NULL,
+};
+
+const struct {
+    const char *name;
+    int width, height;
+    uint64_t seed;
+    const char *pieces;
+    const char **board;
+    int depth;
+    uint64_t expected;
+} suite[] = {
+    {"empty", 10, 20, 1, NULL, NULL, 4, 194522},
+    {"repeats", 10, 20, 1, "IIII", NULL, 4, 92025},
+    {"tspin", 10, 20, 1, "TSZLJIO", stack_board, 3, 11258},
+    {"wide", 16, 20, 2, NULL, NULL, 3, 102252},
+    {"tall", 10, 40, 3, NULL, NULL, 3, 10575},
+    {"generic", 12, 24, 4, NULL, NULL, 3, 20212},
+};
+
+int run_suite(Arena **arenas, int threads) {
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(suite) / sizeof(suite[0]); i++) {
+        setup_root(suite[i].width, suite[i].height, suite[i].seed, suite[i].pieces, suite[i].board,
+                   suite[i].depth);
+        PerftResult r = run_perft(arenas, threads, suite[i].depth);
+        print_result(suite[i].name, suite[i].depth, r);
+        if (r.count != suite[i].expected) {
+            printf("MISMATCH: %s expected %llu\n", suite[i].name, (unsigned long long)suite[i].expected);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+// Every depth up to the given one against the plain search, and against
+// the generic kernel when the size has its own
+int run_check(Arena **arenas, int threads, int depth) {
+    int failed = 0;
+    TableEntry *saved = table;
+    for (int d = 1; d <= depth; d++) {
+        PerftResult r = run_perft(arenas, threads, d);
+        print_result("table", d, r);
+        table = NULL;
+        PerftResult plain = run_perft(arenas, 1, d);
+        print_result("plain", d, plain);
+        int kernel = root.kernel;
+        PerftResult generic = plain;
+        if (kernel != KERNEL_GENERIC) {
+            root.kernel = KERNEL_GENERIC;
+            generic = run_perft(arenas, 1, d);
+            root.kernel = kernel;
+            print_result("generic", d, generic);
+        }
+        table = saved;
+        if (r.count != plain.count || generic.count != plain.count) {
+            printf("MISMATCH at depth %d\n", d);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    int depth = 3;
+    int width = BOARD_WIDTH, height = BOARD_HEIGHT;
+    uint64_t seed = 1;
+    const char *pieces = NULL, *board_path = NULL;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    long hash_mb = 64;
+    int generic = 0, check = 0, run_all = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+            depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            sscanf(argv[++i], "%dx%d", &width, &height);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--pieces") == 0 && i + 1 < argc) {
+            pieces = argv[++i];
+        } else if (strcmp(argv[i], "--board") == 0 && i + 1 < argc) {
+            board_path = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--hash") == 0 && i + 1 < argc) {
+            hash_mb = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--generic") == 0) {
+            generic = 1;
+        } else if (strcmp(argv[i], "--check") == 0) {
+            check = 1;
+        } else if (strcmp(argv[i], "--suite") == 0) {
+            run_all = 1;
+        }
+    }
+    if (depth < 1) depth = 1;
+    if (depth > PERFT_MAX_DEPTH) depth = PERFT_MAX_DEPTH;
+    if (threads < 1) threads = 1;
+
+    tetris_init_tables();
+    init_keys();
+    if (hash_mb > 0) {
+        // Largest power of two number of entries that fits
+        uint64_t entries = 1;
+        while (entries * 2 * sizeof(TableEntry) <= (uint64_t)hash_mb << 20) entries *= 2;
+        table = aligned_alloc(64, entries * sizeof(TableEntry));
+        table_mask = entries - 1;
+    }
+    Arena *arenas[threads];
+    for (int t = 0; t < threads; t++) arenas[t] = aligned_alloc(64, (sizeof(Arena) + 63) / 64 * 64);
+    for (int t = 0; t < threads; t++) arenas[t]->stamp = UINT32_MAX; // clears on first use
+
+    int failed = 0;
+    if (run_all) {
+        failed = run_suite(arenas, threads);
+    } else {
+        if (!setup_root(width, height, seed, pieces, NULL, depth)) return 1;
+        if (board_path && !load_board(&root, board_path)) {
+            fprintf(stderr, "can't read board %s\n", board_path);
+            return 1;
+        }
+        // The board may have changed what fits at the spawn point
+        if (board_path) tetris_place_piece(&root, sequence[0]);
+        root.next_id = sequence[1];
+        if (generic) root.kernel = KERNEL_GENERIC;
+        print_root(depth);
+        if (check) {
+            failed = run_check(arenas, threads, depth);
+        } else if (!root.game_over) {
+            for (int d = 1; d <= depth; d++) print_result("1 thread", d, run_perft(arenas, 1, d));
+            if (threads > 1) {
+                char label[32];
+                snprintf(label, sizeof(label), "%d threads", threads);
+                print_result(label, depth, run_perft(arenas, threads, depth));
+            }
+        }
+    }
+
+    for (int t = 0; t < threads; t++) free(arenas[t]);
+    free(table);
+    return failed;
+}
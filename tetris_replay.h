@@ -0,0 +1,233 @@
+// Compact replays for tetris_engine.h games. A game is fully determined by
+// its seed and the commands sent to it, so that's all a replay keeps: the
+// non-tick commands, each with the number of CMD_TICK frames since the one
+// before it. Delta and command share one LEB128 varint (delta * 8 + command),
+// which makes a typical input a single byte.
+//
+// File layout, integers as varints unless noted:
+//   "TRP1"  flags (1 byte, bit 0 = animate_clears, bit 1 = board size
+//   follows)  seed (8 bytes, LE)  [width  height (1 byte each)]
+//   frames  lines  score  checksum (4 bytes, LE)  input count  inputs...
+// Replays without the size are on the standard board.
+//
+// The final lines, score and a checksum of the board are stored alongside,
+// so replaying against a changed engine shows whether it still plays the
+// same game.
+#ifndef TETRIS_REPLAY_H
+#define TETRIS_REPLAY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tetris_engine.h"
+
+#define REPLAY_MAGIC "TRP1"
+
+typedef struct {
+    uint64_t seed;
+    int animate_clears;
+    int width, height;
+    // Final state of the recorded game
+    uint64_t frames, lines, score;
+    uint32_t checksum;
+    // Encoded inputs
+    uint8_t *data;
+    size_t len, cap;
+    uint64_t inputs;
+    uint64_t last_frame; // frame of the last recorded input
+} Replay;
+
+// The checksum hashes rows as the engine first stored them: the cells
+// REPLAY_PAD bits in with set walls either side, then REPLAY_FLOOR solid
+// rows, so replays recorded back then still verify
+#define REPLAY_PAD 3
+#define REPLAY_FLOOR 4
+
+// FNV-1a over the board rows (each row as the fewest little-endian bytes
+// that hold it), score and lines
+static inline uint32_t replay_checksum(const GameState *state) {
+    uint32_t h = 2166136261u;
+    uint32_t full = (1u << (state->width + 2 * REPLAY_PAD)) - 1;
+    uint32_t walls = full & ~((uint32_t)CELLS_ROW(state->width) << REPLAY_PAD);
+    int row_bytes = (state->width + 2 * REPLAY_PAD + 7) / 8;
+    for (int i = 0; i < state->height + REPLAY_FLOOR; i++) {
+        uint32_t row = i < state->height ? walls | (uint32_t)state->board[i] << REPLAY_PAD : full;
+        for (int b = 0; b < row_bytes; b++) h = (h ^ (uint8_t)(row >> (8 * b))) * 16777619u;
+    }
+    const uint8_t *p;
+    uint32_t tail[2] = {state->score, state->total_lines};
+    p = (const uint8_t *)tail;
+    for (size_t i = 0; i < sizeof(tail); i++) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static inline void replay_put_varint(Replay *r, uint64_t v) {
+    if (r->len + 10 > r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 4096;
+        r->data = realloc(r->data, r->cap);
+    }
+    do {
+        uint8_t byte = v & 0x7f;
+        v >>= 7;
+        r->data[r->len++] = byte | (v ? 0x80 : 0);
+    } while (v);
+}
+
+// 0 when the buffer runs out mid-value
+static inline int replay_get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*p)++;
+        *v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return 1;
+    }
+    return 0;
+}
+
+// Start recording a game just set up from seed
+static inline void replay_begin(Replay *r, const GameState *state, uint64_t seed) {
+    r->seed = seed;
+    r->animate_clears = state->animate_clears;
+    r->width = state->width;
+    r->height = state->height;
+    r->frames = r->lines = r->score = 0;
+    r->checksum = 0;
+    r->len = 0;
+    r->inputs = 0;
+    r->last_frame = 0;
+}
+
+// Note a command as it is sent to the game
+static inline void replay_record(Replay *r, Command cmd) {
+    if (cmd == CMD_TICK) {
+        r->frames++;
+        return;
+    }
+    replay_put_varint(r, (r->frames - r->last_frame) * 8 + cmd);
+    r->last_frame = r->frames;
+    r->inputs++;
+}
+
+// Remember how the game came out, for replay_verify()
+static inline void replay_finish(Replay *r, const GameState *state) {
+    r->lines = state->total_lines;
+    r->score = state->score;
+    r->checksum = replay_checksum(state);
+}
+
+static inline void replay_free(Replay *r) {
+    free(r->data);
+    r->data = NULL;
+    r->len = r->cap = 0;
+}
+
+static inline int replay_save(const Replay *r, const char *path) {
+    Replay head = {0};
+    uint8_t fixed[15];
+    size_t fixed_len = 13;
+    int sized = r->width != BOARD_WIDTH || r->height != BOARD_HEIGHT;
+    memcpy(fixed, REPLAY_MAGIC, 4);
+    fixed[4] = (r->animate_clears ? 1 : 0) | (sized ? 2 : 0);
+    for (int i = 0; i < 8; i++) fixed[5 + i] = r->seed >> (8 * i);
+    if (sized) {
+        fixed[fixed_len++] = r->width;
+        fixed[fixed_len++] = r->height;
+    }
+    replay_put_varint(&head, r->frames);
+    replay_put_varint(&head, r->lines);
+    replay_put_varint(&head, r->score);
+    uint8_t sum[4];
+    for (int i = 0; i < 4; i++) sum[i] = r->checksum >> (8 * i);
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        replay_free(&head);
+        return 0;
+    }
+    fwrite(fixed, 1, fixed_len, f);
+    fwrite(head.data, 1, head.len, f);
+    fwrite(sum, 1, sizeof(sum), f);
+    head.len = 0;
+    replay_put_varint(&head, r->inputs);
+    fwrite(head.data, 1, head.len, f);
+    fwrite(r->data, 1, r->len, f);
+    replay_free(&head);
+    return fclose(f) == 0;
+}
+
+static inline int replay_load(Replay *r, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *buf = size > 0 ? malloc(size) : NULL;
+    int ok = buf && fread(buf, 1, size, f) == (size_t)size;
+    fclose(f);
+
+    const uint8_t *p = buf, *end = buf + (ok ? size : 0);
+    ok = ok && size >= 13 && memcmp(p, REPLAY_MAGIC, 4) == 0;
+    if (ok) {
+        int flags = p[4];
+        r->animate_clears = flags & 1;
+        r->seed = 0;
+        for (int i = 0; i < 8; i++) r->seed |= (uint64_t)p[5 + i] << (8 * i);
+        p += 13;
+        r->width = BOARD_WIDTH;
+        r->height = BOARD_HEIGHT;
+        if (flags & 2) {
+            ok = end - p >= 2;
+            if (ok) {
+                r->width = p[0];
+                r->height = p[1];
+                p += 2;
+            }
+        }
+    }
+    ok = ok && replay_get_varint(&p, end, &r->frames);
+    ok = ok && replay_get_varint(&p, end, &r->lines);
+    ok = ok && replay_get_varint(&p, end, &r->score);
+    ok = ok && end - p >= 4;
+    if (ok) {
+        r->checksum = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+        p += 4;
+    }
+    ok = ok && replay_get_varint(&p, end, &r->inputs);
+    if (ok) {
+        // Keep the inputs, the buffer becomes the replay's
+        r->len = r->cap = end - p;
+        memmove(buf, p, r->len);
+        r->data = buf;
+        r->last_frame = 0;
+    } else {
+        free(buf);
+    }
+    return ok;
+}
+
+// Re-simulate the game as fast as the engine goes. Returns 0 if the inputs
+// are truncated or corrupt.
+static inline int replay_play(const Replay *r, GameState *state) {
+    tetris_init_game_sized(state, r->seed, r->width, r->height);
+    state->animate_clears = r->animate_clears;
+    const uint8_t *p = r->data, *end = r->data + r->len;
+    uint64_t frame = 0;
+    for (uint64_t i = 0; i < r->inputs; i++) {
+        uint64_t v;
+        if (!replay_get_varint(&p, end, &v) || v % 8 >= CMD_TICK) return 0;
+        for (uint64_t target = frame + v / 8; frame < target; frame++) tetris_command(state, CMD_TICK);
+        tetris_command(state, (Command)(v % 8));
+    }
+    for (; frame < r->frames; frame++) tetris_command(state, CMD_TICK);
+    return 1;
+}
+
+// Does the state replay_play() left behind match the recorded game?
+static inline int replay_verify(const Replay *r, const GameState *state) {
+    return (uint64_t)state->total_lines == r->lines && (uint64_t)state->score == r->score &&
+           replay_checksum(state) == r->checksum;
+}
+
+#endif
@@ -0,0 +1,86 @@
+// Snapshots of tetris_engine.h games for undo, rollback and search.
+//
+// A GameState is 128 bytes of plain data (two cache lines), so a snapshot
+// is just a copy of it. The one thing not copied back is where the game's
+// events go: a restored game keeps its own event queue, emptied, since the
+// events in it belong to play that was undone.
+//
+// A SnapshotRing holds the last `depth` snapshots, the oldest overwritten
+// first, for stepping back through recent play.
+#ifndef TETRIS_SNAPSHOT_H
+#define TETRIS_SNAPSHOT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tetris_engine.h"
+
+typedef GameState GameSnapshot;
+
+static inline void snapshot_save(const GameState *state, GameSnapshot *snap) {
+    memcpy(snap, state, sizeof(GameState));
+}
+
+// Put the game back as it was saved, whatever size it was playing on since
+static inline void snapshot_restore(GameState *state, const GameSnapshot *snap) {
+    EventQueue *events = state->events;
+    memcpy(state, snap, sizeof(GameState));
+    tetris_set_events(state, events);
+}
+
+typedef struct {
+    GameSnapshot *slots;
+    int depth; // slots, the most snapshots held at once
+    int head;  // slot the next push goes to
+    int count; // snapshots held
+} SnapshotRing;
+
+static inline void snapshot_ring_init(SnapshotRing *ring, int depth) {
+    ring->depth = depth < 1 ? 1 : depth;
+    ring->slots = aligned_alloc(64, ring->depth * sizeof(GameSnapshot));
+    ring->head = 0;
+    ring->count = 0;
+}
+
+static inline void snapshot_ring_free(SnapshotRing *ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+    ring->depth = ring->count = 0;
+}
+
+static inline void snapshot_ring_clear(SnapshotRing *ring) {
+    ring->head = 0;
+    ring->count = 0;
+}
+
+// Save the game as the newest snapshot, dropping the oldest when full.
+// Returns the slot it went to.
+static inline GameSnapshot *snapshot_push(SnapshotRing *ring, const GameState *state) {
+    GameSnapshot *snap = &ring->slots[ring->head];
+    snapshot_save(state, snap);
+    if (++ring->head == ring->depth) ring->head = 0;
+    if (ring->count < ring->depth) ring->count++;
+    return snap;
+}
+
+// The snapshot `back` before the newest (0 is the newest), NULL if the ring
+// doesn't reach that far
+static inline GameSnapshot *snapshot_peek(const SnapshotRing *ring, int back) {
+    if (back < 0 || back >= ring->count) return NULL;
+    return &ring->slots[(ring->head - 1 - back + ring->depth) % ring->depth];
+}
+
+// Restore the snapshot `back` before the newest and forget the newer ones,
+// so it becomes the newest. Returns it, or NULL (and leaves the game alone)
+// if the ring doesn't reach that far.
+static inline GameSnapshot *snapshot_rollback(SnapshotRing *ring, int back, GameState *state) {
+    GameSnapshot *snap = snapshot_peek(ring, back);
+    if (!snap) return NULL;
+    snapshot_restore(state, snap);
+    ring->head = (ring->head - back + ring->depth) % ring->depth;
+    ring->count -= back;
+    return snap;
+}
+
+#endif
@@ -0,0 +1,340 @@
+// Genetic trainer for the tetris_bot.h heuristic weights.
+//
+// Every generation each weight vector in the population plays the same set
+// of seeded headless games, spread over all cores, and scores the lines it
+// cleared per game. The best few survive unchanged, the rest of the next
+// generation is bred from tournament winners: a fitness-weighted average of
+// two parents, sometimes nudged along one feature, scaled to unit length
+// (only the direction of the weight vector changes which move wins).
+//
+//   cc -O2 tetris_train.c -o tetris_train -lpthread -lm
+//   ./tetris_train [--population N] [--games N] [--pieces N] [--generations N]
+//                  [--depth N] [--beam N] [--threads N] [--seed N] [--size WxH]
+//                  [--checkpoint FILE] [--resume FILE]
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tetris_engine.h"
+#include "tetris_bot.h"
+
+#define MAX_POPULATION 1024
+#define ELITE_FRACTION 0.1
+#define TOURNAMENT_SIZE 5
+#define MUTATION_RATE 0.3
+#define MUTATION_STEP 0.2
+
+typedef struct {
+    BotWeights weights;
+    double fitness; // lines per game in the last generation
+} Individual;
+
+// Everything a thread needs to play, allocated once up front so the games
+// themselves never touch the heap
+typedef struct {
+    Bot bot;
+    GameState state;
+    long pieces;
+} Arena;
+
+Individual population[MAX_POPULATION];
+int population_size = 64;
+long games_per_individual = 32;
+long max_pieces = 500;
+int depth = 1;
+int beam = 8;
+int board_width = BOARD_WIDTH, board_height = BOARD_HEIGHT;
+
+// Generation being played: one job per (individual, game)
+uint64_t generation_seed;
+atomic_long next_job;
+long job_count;
+long *job_lines;
+
+double get_time_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double random_unit(uint64_t *rng) {
+    return tetris_next_random(rng) / 4294967296.0;
+}
+
+// Box-Muller, one value is plenty here
+double random_gaussian(uint64_t *rng) {
+    double u = random_unit(rng) + 1e-12;
+    double v = random_unit(rng);
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+void normalize(BotWeights *w) {
+    double len = sqrt(w->height * w->height + w->holes * w->holes +
+                      w->bumpiness * w->bumpiness + w->lines * w->lines);
+    if (len == 0) return;
+    w->height /= len;
+    w->holes /= len;
+    w->bumpiness /= len;
+    w->lines /= len;
+}
+
+// Play one game with the arena's bot, returns lines cleared
+long play_game(Arena *arena, const BotWeights *weights, uint64_t seed) {
+    GameState *state = &arena->state;
+    arena->bot.weights = *weights;
+    tetris_init_game_sized(state, seed, board_width, board_height);
+    for (long p = 0; p < max_pieces && !state->game_over; p++) {
+        Placement move;
+        if (!bot_choose(&arena->bot, state, &move)) break;
+        Command cmds[BOT_MAX_CMDS];
+        int n = bot_placement_commands(&move, cmds);
+        for (int c = 0; c < n; c++) tetris_command(state, cmds[c]);
+        arena->pieces++;
+    }
+    return state->total_lines;
+}
+
+void *trainer_main(void *arg) {
+    Arena *arena = arg;
+    for (;;) {
+        long job = atomic_fetch_add_explicit(&next_job, 1, memory_order_relaxed);
+        if (job >= job_count) break;
+        long ind = job / games_per_individual;
+        long game = job % games_per_individual;
+        // Every individual sees the same games within a generation
+        job_lines[job] = play_game(arena, &population[ind].weights, generation_seed + game);
+    }
+    return NULL;
+}
+
+int compare_fitness(const void *a, const void *b) {
+    double x = ((const Individual *)a)->fitness, y = ((const Individual *)b)->fitness;
+    return (x < y) - (x > y); // best first
+}
+
+const Individual *tournament(uint64_t *rng) {
+    const Individual *best = NULL;
+    for (int i = 0; i < TOURNAMENT_SIZE; i++) {
+        const Individual *pick = &population[tetris_next_random(rng) % population_size];
+        if (!best || pick->fitness > best->fitness) best = pick;
+    }
+    return best;
+}
+
+// Population sorted best first: keep the elite, breed the rest
+void next_generation(uint64_t *rng) {
+    static Individual children[MAX_POPULATION];
+    int elite = population_size * ELITE_FRACTION;
+    if (elite < 1) elite = 1;
+
+    for (int i = elite; i < population_size; i++) {
+        const Individual *a = tournament(rng);
+        const Individual *b = tournament(rng);
+        double fa = a->fitness + 1e-9, fb = b->fitness + 1e-9;
+        BotWeights w = {
+            a->weights.height * fa + b->weights.height * fb,
+            a->weights.holes * fa + b->weights.holes * fb,
+            a->weights.bumpiness * fa + b->weights.bumpiness * fb,
+            a->weights.lines * fa + b->weights.lines * fb,
+        };
+        if (random_unit(rng) < MUTATION_RATE) {
+            double *feature = &w.height + tetris_next_random(rng) % 4;
+            *feature += random_gaussian(rng) * MUTATION_STEP * (fa + fb);
+        }
+        normalize(&w);
+        children[i] = (Individual){w, 0};
+    }
+    for (int i = elite; i < population_size; i++) population[i] = children[i];
+}
+
+// Settings the games (and so the fitness) depend on, saved with the population
+// so a resume plays the same games the run would have
+typedef struct {
+    uint64_t seed;
+    long games;
+    long pieces;
+    int width, height;
+    int depth, beam; // the bot's search
+} RunSettings;
+
+int save_checkpoint(const char *path, int generation, uint64_t rng, const RunSettings *run) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f) return 0;
+    fprintf(f, "generation %d\nrng %llu\nseed %llu\ngames %ld\npieces %ld\nsize %dx%d\n"
+            "depth %d\nbeam %d\npopulation %d\n",
+            generation, (unsigned long long)rng, (unsigned long long)run->seed, run->games,
+            run->pieces, run->width, run->height, run->depth, run->beam, population_size);
+    for (int i = 0; i < population_size; i++) {
+        const BotWeights *w = &population[i].weights;
+        fprintf(f, "%.17g %.17g %.17g %.17g %.17g\n",
+                w->height, w->holes, w->bumpiness, w->lines, population[i].fitness);
+    }
+    int ok = fclose(f) == 0;
+    // Never leave a half-written checkpoint in place of the last good one
+    return ok && rename(tmp, path) == 0;
+}
+
+int load_checkpoint(const char *path, int *generation, uint64_t *rng, RunSettings *run) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    unsigned long long state, seed;
+    int ok = fscanf(f, "generation %d\nrng %llu\nseed %llu\ngames %ld\npieces %ld\nsize %dx%d\n"
+                    "depth %d\nbeam %d\npopulation %d\n",
+                    generation, &state, &seed, &run->games, &run->pieces, &run->width, &run->height,
+                    &run->depth, &run->beam, &population_size) == 10;
+    ok = ok && population_size > 0 && population_size <= MAX_POPULATION;
+    for (int i = 0; ok && i < population_size; i++) {
+        BotWeights *w = &population[i].weights;
+        ok = fscanf(f, "%lf %lf %lf %lf %lf", &w->height, &w->holes, &w->bumpiness,
+                    &w->lines, &population[i].fitness) == 5;
+    }
+    fclose(f);
+    *rng = state;
+    run->seed = seed;
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int generations = 20;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t seed = 1;
+    const char *checkpoint = NULL, *resume = NULL;
+    int seed_set = 0, games_set = 0, pieces_set = 0, size_set = 0, depth_set = 0, beam_set = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--population") == 0 && i + 1 < argc) {
+            population_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--games") == 0 && i + 1 < argc) {
+            games_per_individual = atol(argv[++i]);
+            games_set = 1;
+        } else if (strcmp(argv[i], "--pieces") == 0 && i + 1 < argc) {
+            max_pieces = atol(argv[++i]);
+            pieces_set = 1;
+        } else if (strcmp(argv[i], "--generations") == 0 && i + 1 < argc) {
+            generations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+            depth = atoi(argv[++i]);
+            depth_set = 1;
+        } else if (strcmp(argv[i], "--beam") == 0 && i + 1 < argc) {
+            beam = atoi(argv[++i]);
+            beam_set = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            sscanf(argv[++i], "%dx%d", &board_width, &board_height);
+            size_set = 1;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+            seed_set = 1;
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint = argv[++i];
+        } else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc) {
+            resume = argv[++i];
+        }
+    }
+    if (population_size < 2) population_size = 2;
+    if (population_size > MAX_POPULATION) population_size = MAX_POPULATION;
+    if (games_per_individual < 1) games_per_individual = 1;
+    if (threads < 1) threads = 1;
+    // What bot_init() would clamp them to, so the checkpoint has what ran
+    depth = depth < 1 ? 1 : depth > BOT_MAX_DEPTH ? BOT_MAX_DEPTH : depth;
+    beam = beam < 1 ? 1 : beam > BOT_MAX_BEAM ? BOT_MAX_BEAM : beam;
+
+    uint64_t rng = tetris_seed_random(seed);
+    int first = 0;
+    if (resume) {
+        RunSettings saved;
+        if (!load_checkpoint(resume, &first, &rng, &saved)) {
+            fprintf(stderr, "can't read checkpoint %s\n", resume);
+            return 1;
+        }
+        // Carry on with the checkpoint's games unless told otherwise, and
+        // refuse to mix two different sets of games in one run
+        if ((seed_set && seed != saved.seed) || (games_set && games_per_individual != saved.games) ||
+            (pieces_set && max_pieces != saved.pieces) ||
+            (size_set && (board_width != saved.width || board_height != saved.height)) ||
+            (depth_set && depth != saved.depth) || (beam_set && beam != saved.beam)) {
+            fprintf(stderr, "%s was trained with --seed %llu --games %ld --pieces %ld --size %dx%d"
+                    " --depth %d --beam %d\n", resume, (unsigned long long)saved.seed, saved.games,
+                    saved.pieces, saved.width, saved.height, saved.depth, saved.beam);
+            return 1;
+        }
+        seed = saved.seed;
+        games_per_individual = saved.games;
+        max_pieces = saved.pieces;
+        board_width = saved.width;
+        board_height = saved.height;
+        depth = saved.depth;
+        beam = saved.beam;
+        fprintf(stderr, "resumed %s at generation %d\n", resume, first);
+    } else {
+        // Random directions, plus the stock weights as a baseline to beat
+        for (int i = 0; i < population_size; i++) {
+            BotWeights w = {random_unit(&rng) - 0.5, random_unit(&rng) - 0.5,
+                            random_unit(&rng) - 0.5, random_unit(&rng) - 0.5};
+            if (i == 0) w = bot_default_weights;
+            normalize(&w);
+            population[i] = (Individual){w, 0};
+        }
+    }
+
+    RunSettings run = {seed, games_per_individual, max_pieces, board_width, board_height, depth, beam};
+    tetris_init_tables();
+    job_count = population_size * games_per_individual;
+    job_lines = malloc(job_count * sizeof(long));
+    Arena *arenas[threads];
+    pthread_t ids[threads];
+    for (int t = 0; t < threads; t++) {
+        arenas[t] = aligned_alloc(64, (sizeof(Arena) + 63) / 64 * 64);
+        bot_init(&arenas[t]->bot, 1, depth, beam, bot_default_weights);
+    }
+
+    for (int gen = first; gen < first + generations; gen++) {
+        generation_seed = tetris_seed_random(seed ^ (uint64_t)gen << 32);
+        atomic_store(&next_job, 0);
+        for (int t = 0; t < threads; t++) arenas[t]->pieces = 0;
+
+        double t0 = get_time_seconds();
+        for (int t = 1; t < threads; t++) pthread_create(&ids[t], NULL, trainer_main, arenas[t]);
+        trainer_main(arenas[0]);
+        for (int t = 1; t < threads; t++) pthread_join(ids[t], NULL);
+        double elapsed = get_time_seconds() - t0;
+
+        long pieces = 0, lines = 0;
+        for (int t = 0; t < threads; t++) pieces += arenas[t]->pieces;
+        for (int i = 0; i < population_size; i++) {
+            long sum = 0;
+            for (long g = 0; g < games_per_individual; g++) sum += job_lines[i * games_per_individual + g];
+            population[i].fitness = (double)sum / games_per_individual;
+            lines += sum;
+        }
+        qsort(population, population_size, sizeof(Individual), compare_fitness);
+
+        const BotWeights *best = &population[0].weights;
+        printf("gen %3d  best %7.1f  mean %7.1f lines/game  %9.0f pieces/s  %6.2f s"
+               "  [%.4f %.4f %.4f %.4f]\n",
+               gen, population[0].fitness, (double)lines / job_count, pieces / elapsed, elapsed,
+               best->height, best->holes, best->bumpiness, best->lines);
+        fflush(stdout);
+
+        // Checkpoint the bred population so a resume carries straight on
+        next_generation(&rng);
+        if (checkpoint && !save_checkpoint(checkpoint, gen + 1, rng, &run)) {
+            fprintf(stderr, "can't write checkpoint %s\n", checkpoint);
+        }
+    }
+
+    for (int t = 0; t < threads; t++) {
+        bot_free(&arenas[t]->bot);
+        free(arenas[t]);
+    }
+    free(job_lines);
+    return 0;
+}